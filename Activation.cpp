@@ -0,0 +1,135 @@
+/// Activation.cpp - Vectorized activation functions
+/// Nathaniel Rupprecht 2016
+///
+/// The loops below have no function calls or data dependent control flow, so
+/// the compiler vectorizes them. With gcc each kernel is also compiled for
+/// AVX-512 and AVX2 and the right version is picked at run time.
+///
+
+#include "Activation.h"
+
+const char* activationName(ActivationType type) {
+  switch (type) {
+  case ActSigmoid: return "sigmoid";
+  case ActTanh: return "tanh";
+  case ActReLU: return "relu";
+  case ActSoftplus: return "softplus";
+  default: return "unknown";
+  }
+}
+
+/// log(1+x) for 0 <= x <= 1, as 2*atanh(x/(2+x)). The series argument is at most 1/3.
+/// s*s is flushed to zero while it is still far above the denormal range, which is slow
+inline real smallLog1p(real x) {
+  real s = x/(2+x);
+#ifdef NN_FLOAT
+  real s2 = s>1e-15f ? s*s : 0;
+  real p = 1.f/15;
+  p = p*s2 + 1.f/13; p = p*s2 + 1.f/11; p = p*s2 + 1.f/9; p = p*s2 + 1.f/7;
+  p = p*s2 + 1.f/5; p = p*s2 + 1.f/3; p = p*s2 + 1;
+#else
+  real s2 = s>1e-100 ? s*s : 0;
+  real p = 1./33;
+  p = p*s2 + 1./31; p = p*s2 + 1./29; p = p*s2 + 1./27; p = p*s2 + 1./25; p = p*s2 + 1./23;
+  p = p*s2 + 1./21; p = p*s2 + 1./19; p = p*s2 + 1./17; p = p*s2 + 1./15; p = p*s2 + 1./13;
+  p = p*s2 + 1./11; p = p*s2 + 1./9; p = p*s2 + 1./7; p = p*s2 + 1./5; p = p*s2 + 1./3;
+  p = p*s2 + 1;
+#endif
+  return 2*s*p;
+}
+
+// Each activation provides its value, its value and derivative at once from a
+// single exponential, and its derivative in terms of the output a = f(z). The
+// backward pass uses the output form by default, so it needs nothing stored from
+// the forward pass. Forms like a*(1-a) or (1-a)*(1+a) only lose relative
+// precision in the saturated tail, where a rounds to (nearly) 0 or +-1 and f'(z)
+// is tiny anyway. With Network::setCacheDerivatives(true), f'(z) is instead kept
+// from the forward pass in terms of e = exp(-|z|), which stays exact there too
+
+struct SigmoidFn {
+  static real value(real z) { return 1/(1+fastExp(-z)); }
+  static void both(real z, real& a, real& d) {
+    real e = fastExp(z>0 ? -z : z), r = 1/(1+e);
+    a = z>0 ? r : e*r;
+    d = e*r*r;
+  }
+  static real fromOutput(real a) { return a*(1-a); }
+};
+
+// tanh(z) = sign(z) * (1-e)/(1+e) with e = exp(-2|z|)
+struct TanhFn {
+  static real value(real z) {
+    real e = fastExp(z>0 ? -2*z : 2*z);
+    real t = (1-e)/(1+e);
+    return z>0 ? t : -t;
+  }
+  static void both(real z, real& a, real& d) {
+    real e = fastExp(z>0 ? -2*z : 2*z), r = 1/(1+e);
+    real t = (1-e)*r;
+    a = z>0 ? t : -t;
+    d = 4*e*r*r;
+  }
+  static real fromOutput(real a) { return (1-a)*(1+a); }
+};
+
+struct ReLUFn {
+  static real value(real z) { return z>0 ? z : 0; }
+  static void both(real z, real& a, real& d) {
+    a = value(z);
+    d = z>0 ? 1 : 0;
+  }
+  static real fromOutput(real a) { return a>0 ? 1 : 0; }
+};
+
+// log(1+e^z) = max(z, 0) + log(1+e^-|z|)
+struct SoftplusFn {
+  static real value(real z) { return (z>0 ? z : 0) + smallLog1p(fastExp(z>0 ? -z : z)); }
+  static void both(real z, real& a, real& d) {
+    real e = fastExp(z>0 ? -z : z);
+    a = (z>0 ? z : 0) + smallLog1p(e);
+    d = z>0 ? 1/(1+e) : e/(1+e);
+  }
+  static real fromOutput(real a) { return 1-fastExp(-a); } // sigmoid(z) = 1-exp(-softplus(z))
+};
+
+template<class F> NN_SIMD_CLONES
+void outputDerivativeKernel(const real *a, real *delta, int n) {
+  for (int i=0; i<n; i++) delta[i] *= F::fromOutput(a[i]);
+}
+
+// One row of the fused epilogue: z += bias, a = f(z) and, if deriv is true, d = f'(z)
+template<class F, bool deriv> NN_SIMD_CLONES
+void biasKernel(real *z, real bias, real *a, real *d, int n) {
+  for (int i=0; i<n; i++) {
+    real x = z[i] + bias;
+    z[i] = x;
+    if (deriv) F::both(x, a[i], d[i]);
+    else a[i] = F::value(x);
+  }
+}
+
+template<class F> void biasRows(real *z, const real *bias, real *a, real *d, int rows, int cols) {
+  for (int r=0; r<rows; r++) {
+    int o = r*cols;
+    if (d) biasKernel<F, true>(z+o, bias[r], a+o, d+o, cols);
+    else biasKernel<F, false>(z+o, bias[r], a+o, 0, cols);
+  }
+}
+
+void multiplyDerivativeFromOutput(ActivationType type, const real *a, real *delta, int n) {
+  switch (type) {
+  case ActSigmoid: outputDerivativeKernel<SigmoidFn>(a, delta, n); break;
+  case ActTanh: outputDerivativeKernel<TanhFn>(a, delta, n); break;
+  case ActReLU: outputDerivativeKernel<ReLUFn>(a, delta, n); break;
+  case ActSoftplus: outputDerivativeKernel<SoftplusFn>(a, delta, n); break;
+  }
+}
+
+void biasActivate(ActivationType type, real *z, const real *bias, real *a, real *d, int rows, int cols) {
+  switch (type) {
+  case ActSigmoid: biasRows<SigmoidFn>(z, bias, a, d, rows, cols); break;
+  case ActTanh: biasRows<TanhFn>(z, bias, a, d, rows, cols); break;
+  case ActReLU: biasRows<ReLUFn>(z, bias, a, d, rows, cols); break;
+  case ActSoftplus: biasRows<SoftplusFn>(z, bias, a, d, rows, cols); break;
+  }
+}
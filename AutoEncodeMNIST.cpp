@@ -30,7 +30,7 @@ int main(int argc, char* argv[]) {
   net.setRate(0.01);
   net.setL2const(0.);
 
-  net.createAutoEncoder(neurons, sigmoid, dsigmoid);
+  net.createAutoEncoder(neurons, ActSigmoid);
 
   net.setInputs(inputs);
   net.setTargets(inputs);
@@ -0,0 +1,79 @@
+/// BenchGemm.cpp - GFLOP/s of the gemm backend on our layer shapes
+/// Nathaniel Rupprecht 2016
+///
+/// Usage: BenchGemm [minibatch]
+/// Times the backend the program was built with (see BLAS in the makefile)
+/// next to the built-in gemm, in double and float, for the forward, backward
+/// and weight gradient products of the MNISTNet and CIFARNet layers.
+///
+
+#include "Utility.h"
+
+#include <chrono>
+#include <iomanip>
+
+struct GemmCase {
+  string name;
+  BlasTranspose TA, TB;
+  int m, n, k;
+};
+
+template<typename T> using gemmFunction = void (*) (BlasTranspose, BlasTranspose, int, int, int, T, const T*, int,
+						   const T*, int, T, T*, int);
+
+// Run the case repeatedly for at least a fifth of a second, return GFLOP/s
+template<typename T> double benchmark(const GemmCase& G, gemmFunction<T> F) {
+  vector<T> A(G.m*G.k), B(G.k*G.n), C(G.m*G.n);
+  for (auto& a : A) a = 2*drand48()-1;
+  for (auto& b : B) b = 2*drand48()-1;
+  int lda = G.TA==BlasNoTrans ? G.k : G.m;
+  int ldb = G.TB==BlasNoTrans ? G.n : G.k;
+
+  F(G.TA, G.TB, G.m, G.n, G.k, 1., A.data(), lda, B.data(), ldb, 0., C.data(), G.n); // Warm up
+  int reps = 0;
+  auto start = std::chrono::steady_clock::now();
+  double elapsed = 0;
+  do {
+    F(G.TA, G.TB, G.m, G.n, G.k, 1., A.data(), lda, B.data(), ldb, 0., C.data(), G.n);
+    reps++;
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+  } while (elapsed<0.2);
+  return 2.*G.m*G.n*G.k*reps/elapsed*1e-9;
+}
+
+// The three products a layer (out, in) does per minibatch
+void addLayer(vector<GemmCase>& cases, int in, int out, int batch) {
+  stringstream stream;
+  stream << out << "x" << in;
+  string layer;
+  stream >> layer;
+  cases.push_back(GemmCase{layer+" forward", BlasNoTrans, BlasNoTrans, out, batch, in});
+  cases.push_back(GemmCase{layer+" backward", BlasTrans, BlasNoTrans, in, batch, out});
+  cases.push_back(GemmCase{layer+" gradient", BlasNoTrans, BlasTrans, out, in, batch});
+}
+
+int main(int argc, char* argv[]) {
+  int batch = argc>1 ? atoi(argv[1]) : 50;
+  srand48(0);
+
+  vector<GemmCase> cases;
+  // MNISTNet
+  addLayer(cases, 784, 500, batch);
+  addLayer(cases, 500, 30, batch);
+  addLayer(cases, 30, 10, batch);
+  // CIFARNet
+  addLayer(cases, 3072, 500, batch);
+  addLayer(cases, 500, 100, batch);
+
+  cout << "Minibatch " << batch << ", GFLOP/s, built-in kernel " << builtinGemmKernel() << endl;
+  string backend = blasBackend();
+  cout << std::left << std::setw(22) << "shape" << std::setw(14) << backend+" (d)" << std::setw(14) << "builtin (d)";
+  cout << std::setw(14) << backend+" (f)" << "builtin (f)" << endl;
+  for (auto& G : cases) {
+    cout << std::setw(22) << G.name << std::setw(14) << benchmark<double>(G, gemm);
+    cout << std::setw(14) << benchmark<double>(G, builtinGemm);
+    cout << std::setw(14) << benchmark<float>(G, gemm);
+    cout << benchmark<float>(G, builtinGemm) << endl;
+  }
+  return 0;
+}
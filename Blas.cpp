@@ -0,0 +1,47 @@
+/// Blas.cpp - Matrix multiplication backend
+/// Nathaniel Rupprecht 2016
+///
+
+#include "Blas.h"
+
+#if defined(NN_BLAS_MKL)
+#include <mkl.h>
+#elif defined(NN_BLAS_OPENBLAS)
+#include <cblas.h>
+#elif defined(NN_BLAS_BLIS)
+#include <blis/cblas.h>
+#endif
+
+#ifndef NN_BLAS_BUILTIN
+inline CBLAS_TRANSPOSE cblasTrans(BlasTranspose T) { return T==BlasTrans ? CblasTrans : CblasNoTrans; }
+#endif
+
+void gemm(BlasTranspose TA, BlasTranspose TB, int m, int n, int k, double alpha, const double *A, int lda,
+	  const double *B, int ldb, double beta, double *C, int ldc) {
+#ifdef NN_BLAS_BUILTIN
+  builtinGemm(TA, TB, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+#else
+  cblas_dgemm(CblasRowMajor, cblasTrans(TA), cblasTrans(TB), m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+#endif
+}
+
+void gemm(BlasTranspose TA, BlasTranspose TB, int m, int n, int k, float alpha, const float *A, int lda,
+	  const float *B, int ldb, float beta, float *C, int ldc) {
+#ifdef NN_BLAS_BUILTIN
+  builtinGemm(TA, TB, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+#else
+  cblas_sgemm(CblasRowMajor, cblasTrans(TA), cblasTrans(TB), m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+#endif
+}
+
+const char* blasBackend() {
+#if defined(NN_BLAS_MKL)
+  return "mkl";
+#elif defined(NN_BLAS_OPENBLAS)
+  return "openblas";
+#elif defined(NN_BLAS_BLIS)
+  return "blis";
+#else
+  return "builtin";
+#endif
+}
@@ -0,0 +1,39 @@
+/// Blas.h - Matrix multiplication backend
+/// Nathaniel Rupprecht 2016
+///
+/// The backend is picked at build time by defining one of
+///   NN_BLAS_MKL      - Intel MKL
+///   NN_BLAS_OPENBLAS - OpenBLAS (or any library providing cblas.h)
+///   NN_BLAS_BLIS     - BLIS, through its CBLAS compatibility layer
+///   NN_BLAS_BUILTIN  - The packed, vectorized gemm in Gemm.cpp, no external library
+/// The makefile sets this from its BLAS variable. If nothing is defined we use MKL.
+///
+
+#ifndef BLAS_H
+#define BLAS_H
+
+#if !defined(NN_BLAS_MKL) && !defined(NN_BLAS_OPENBLAS) && !defined(NN_BLAS_BLIS) && !defined(NN_BLAS_BUILTIN)
+#define NN_BLAS_MKL
+#endif
+
+enum BlasTranspose { BlasNoTrans, BlasTrans };
+
+/// Row major C = alpha * op(A) * op(B) + beta * C, where op(A) is (m, k) and op(B) is (k, n)
+void gemm(BlasTranspose TA, BlasTranspose TB, int m, int n, int k, double alpha, const double *A, int lda,
+	  const double *B, int ldb, double beta, double *C, int ldc);
+void gemm(BlasTranspose TA, BlasTranspose TB, int m, int n, int k, float alpha, const float *A, int lda,
+	  const float *B, int ldb, float beta, float *C, int ldc);
+
+/// The built-in gemm. Always available, whatever backend gemm uses
+void builtinGemm(BlasTranspose TA, BlasTranspose TB, int m, int n, int k, double alpha, const double *A, int lda,
+		 const double *B, int ldb, double beta, double *C, int ldc);
+void builtinGemm(BlasTranspose TA, BlasTranspose TB, int m, int n, int k, float alpha, const float *A, int lda,
+		 const float *B, int ldb, float beta, float *C, int ldc);
+
+/// The micro-kernel builtinGemm picked for this CPU
+const char* builtinGemmKernel();
+
+/// The name of the backend gemm uses
+const char* blasBackend();
+
+#endif
@@ -4,6 +4,7 @@
 
 #include "Network.h"
 #include "CIFARUnpack.h"
+#include "SharedDataset.h"
 
 int main(int argc, char* argv[]) {
   // Initialize MPI
@@ -12,16 +13,20 @@ int main(int argc, char* argv[]) {
   MPI_Comm_rank( MPI_COMM_WORLD, &rank );
   MPI_Comm_size( MPI_COMM_WORLD, &size );
 
-  CifarUnpacker unpacker;
   vector<string> fileNames;
   fileNames.push_back("CIFARData/data_batch_1.bin");
   fileNames.push_back("CIFARData/data_batch_2.bin");
   fileNames.push_back("CIFARData/data_batch_3.bin");
   fileNames.push_back("CIFARData/data_batch_4.bin");
   fileNames.push_back("CIFARData/data_batch_5.bin");
-  unpacker.unpackInfo(fileNames);
-  auto images = unpacker.getInputSet();
-  auto labels = unpacker.getLabelSet();
+  // Kept as bytes, normalized as each minibatch is staged. Only the first process
+  // on each node reads the files, all the processes on the node share its copy
+  SharedDataset data;
+  {
+    CifarUnpacker unpacker;
+    if (data.isLeader()) unpacker.unpackInfo(fileNames);
+    data.share(unpacker.getDataset());
+  }
 
   //unpacker.unpackInfo(vector<string>({string("CIFARData/data_batch_5.bin")}));
   //auto testImages = unpacker.getInputSet();
@@ -37,15 +42,15 @@ int main(int argc, char* argv[]) {
   
   net.setRate(0.001);
   net.setL2const(0.);
-  net.createFeedForward(neurons, sigmoid, dsigmoid);
+  net.createFeedForward(neurons, ActSigmoid);
 
-  net.setInputs(images);
-  net.setTargets(labels);
+  net.setTrainingSet(data.getDataset());
 
   //net.setTestInputs(testImages);
   //net.setTestTargets(testLabels);
 
   net.setMinibatch(1000);
+  if (argc>1) net.setThreads(atoi(argv[1])); // Threads per process
   net.setTrainingIters(50);
   net.setCalcError(true);
   net.setDisplay(true);
@@ -59,12 +64,11 @@ int main(int argc, char* argv[]) {
     cout << "aveTime=" << net.getAveTime() << ";\n";
   }
 
-  for (auto p : images) delete p;
-  for (auto p : labels) delete p;
   //for (auto p : testImages) delete p;
   //for (auto p : testLabels) delete p;
 
   // End MPI
+  data.free();
   MPI_Finalize();
 
   return 0;
@@ -17,33 +17,45 @@ using std::endl;
 
 void CifarUnpacker::unpackInfo(vector<string> fileNames) {
 
-    // There should be
+    // Each record is a label byte, then 1024 bytes each for Red, Green, Blue
+    const int record = 3073;
+    vector<char> buffer(record);
     for(auto name : fileNames) {
-        ifstream fin(name);
+        ifstream fin(name, std::ios::binary);
         if(fin.fail()) {
             cout << "File " << name << " failed to open.";
             continue;
         }
         // 10000 Images per file
-        for(int i=0; i<10000; i++) {
-            // Get label
-            char c;
-            fin.get(c);
-            uint label = (uint)c;
+        for(int i=0; i<10000 && fin.read(buffer.data(), record); i++) {
+            labelBytes.push_back(buffer[0]);
+            pixels.insert(pixels.end(), buffer.begin()+1, buffer.end());
+        }
+    }
+    images.clear();
+    labels.clear();
+    dataset.setInputs(pixels.data(), labelBytes.size(), 3072, false);
+    dataset.setLabels(labelBytes.data(), 10, false);
+}
+
+vector<Tensor*> CifarUnpacker::getInputSet() {
+    if (images.empty())
+        for(int i=0; i<dataset.size(); i++) {
+            Tensor *M = new Tensor(3072,1);
+            const uchar *c = dataset.getInput(i);
+            for(int j=0; j<3072; j++) M->at(j,0) = (real)c[j]/255.f;
+            images.push_back(M);
+        }
+    return images;
+}
+
+vector<Tensor*>& CifarUnpacker::getLabelSet() {
+    if (labels.empty())
+        for(int i=0; i<dataset.size(); i++) {
             // Convert label data
             Tensor *M = new Tensor(10,1);
-	    for(int p=0; p<10; p++) M->at(p,0) = p==label ? 1. : 0.;
+            for(int p=0; p<10; p++) M->at(p,0) = p==dataset.getLabel(i) ? 1. : 0.;
             labels.push_back(M);
-            
-	    Tensor *pixels = new Tensor(3072,1);
-            // Get pixels
-            int j;
-            for(j=0; j<3072 && !fin.eof(); j++) { //1024 for Red,Green,Blue -> 3072
-                fin.get(c);
-                pixels->at(j,0) = (double)((unsigned char)c)/255.f;
-            }
-            images.push_back(pixels);
         }
-    }
+    return labels;
 }
-
@@ -16,20 +16,27 @@ using std::string;
 using std::vector;
 
 #include "Tensor.h"
+#include "Dataset.h"
 
 // Store image as a Matrix (column vector) [ red green blue ]
+// The images and labels are kept as bytes, getDataset serves them to the network
+// that way. getInputSet and getLabelSet make tensors of them on first use
 class CifarUnpacker {
 public:
     CifarUnpacker() {};
     
     void unpackInfo(vector<string> fileNames);
     
-    vector<Tensor*> getInputSet()  {return images;}
-    vector<Tensor*>& getLabelSet() {return labels;}
+    const ByteDataset& getDataset() const {return dataset;}
+    vector<Tensor*> getInputSet();
+    vector<Tensor*>& getLabelSet();
     
 private:
     
     // Store the information
+    vector<uchar> pixels;     // 3072 per image, one image after the other
+    vector<uchar> labelBytes;
+    ByteDataset dataset;      // Refers to the two above
     vector<Tensor*> images;
     vector<Tensor*> labels;
 };
@@ -0,0 +1,67 @@
+/// DataLoader.cpp - Implements the DataLoader class
+/// Nathaniel Rupprecht 2016
+///
+
+#include "DataLoader.h"
+
+void DataLoader::start(const Dataset& d, const vector<pair<int,int>>& b, int p, const int *o) {
+  stop();
+  data = &d;
+  order = o;
+  batches = b;
+  parts = p;
+  inputs.resize(parts);
+  targets.resize(parts);
+  filled = taken = -1;
+  quit = false;
+  thread = std::thread(&DataLoader::work, this);
+}
+
+void DataLoader::next() {
+  std::unique_lock<std::mutex> guard(lock);
+  ready.wait(guard, [this] { return filled>taken; });
+}
+
+void DataLoader::release() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    taken++;
+  }
+  consumed.notify_one();
+}
+
+void DataLoader::stop() {
+  if (!thread.joinable()) return;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    quit = true;
+  }
+  consumed.notify_one();
+  thread.join();
+}
+
+void DataLoader::work() {
+  int inSize = data->inputSize(), outSize = data->targetSize();
+  for (int b=0; b<batches.size(); b++) {
+    {
+      // Wait for the trainer to take the batch before
+      std::unique_lock<std::mutex> guard(lock);
+      consumed.wait(guard, [&] { return quit || taken==b-1; });
+      if (quit) return;
+    }
+    int first = batches[b].first, num = batches[b].second;
+    for (int t=0; t<parts; t++) {
+      int begin = num*t/parts, end = num*(t+1)/parts;
+      if (end==begin) continue; // This thread has no samples, and a tensor can't have 0 columns
+      inputs[t].resize(inSize, end-begin);
+      targets[t].resize(outSize, end-begin);
+      if (order) data->stage(order+first+begin, end-begin, inputs[t].getArray(), targets[t].getArray());
+      else data->stage(first+begin, end-begin, inputs[t].getArray(), targets[t].getArray());
+    }
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      filled = b;
+    }
+    ready.notify_one();
+  }
+}
@@ -0,0 +1,56 @@
+/// DataLoader.h - Stages minibatches on a background thread
+/// Nathaniel Rupprecht 2016
+///
+
+#ifndef DATALOADER_H
+#define DATALOADER_H
+
+#include "Dataset.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/// Stages the minibatches of an epoch one ahead of training, on its own thread,
+/// so that gathering and converting the samples overlaps with the computation.
+/// Each batch is split into parts (one per training thread, split the way
+/// Network::trainMinibatch splits it), and each part is a contiguous input and
+/// target tensor with one sample per column. The trainer takes a batch by
+/// swapping those tensors with its own, so nothing is copied: the loader then
+/// fills the trainer's old tensors with the batch after. That makes two buffers
+/// per part, one being trained on and one being filled
+class DataLoader {
+ public:
+  DataLoader() : data(0), order(0), parts(0), filled(-1), taken(-1), quit(false) {};
+  ~DataLoader() { stop(); }
+
+  /// Start staging batches[b] = (first sample, number of samples) of data, in order.
+  /// With an order, the samples are order[first], ..., order[first+number-1] instead
+  void start(const Dataset& data, const vector<pair<int,int>>& batches, int parts, const int *order=0);
+  /// Wait until the next batch is staged. Its parts are in input(t) and target(t)
+  /// until release is called, which lets the loader go on to the batch after
+  void next();
+  void release();
+  /// Stop the loader thread, whether or not it has staged all the batches
+  void stop();
+
+  Tensor& input(int t) { return inputs[t]; }
+  Tensor& target(int t) { return targets[t]; }
+
+ private:
+  void work();
+
+  const Dataset *data;
+  const int *order;
+  vector<pair<int,int>> batches;
+  int parts;
+  vector<Tensor> inputs, targets; // One per part
+  std::thread thread;
+  std::mutex lock;
+  std::condition_variable ready, consumed;
+  int filled; // The last batch staged
+  int taken;  // The last batch the trainer is done taking
+  bool quit;
+};
+
+#endif
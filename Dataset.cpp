@@ -0,0 +1,92 @@
+/// Dataset.cpp - Implements the datasets
+/// Nathaniel Rupprecht 2016
+///
+
+#include "Dataset.h"
+
+#include <string.h> // For memset
+
+/// Stage the samples sample(0), ..., sample(num-1)
+template<typename Index> void TensorDataset::gather(Index sample, int num, real *in, real *tar) const {
+  int inSize = inputSize(), outSize = targetSize();
+  for (int j=0; j<num; j++) {
+    const real *x = inputs->at(sample(j))->getArray();
+    for (int i=0; i<inSize; i++) in[i*num+j] = x[i];
+    const real *y = targets->at(sample(j))->getArray();
+    for (int i=0; i<outSize; i++) tar[i*num+j] = y[i];
+  }
+}
+
+void TensorDataset::stage(int first, int num, real *in, real *tar) const {
+  gather([=] (int j) { return first+j; }, num, in, tar);
+}
+
+void TensorDataset::stage(const int *index, int num, real *in, real *tar) const {
+  gather([=] (int j) { return index[j]; }, num, in, tar);
+}
+
+ByteDataset& ByteDataset::operator=(const ByteDataset& d) {
+  byteStore = d.byteStore;
+  labelStore = d.labelStore;
+  // Copies point to their own stores
+  bytes = d.bytes==d.byteStore.data() ? byteStore.data() : d.bytes;
+  labels = d.labels==d.labelStore.data() ? labelStore.data() : d.labels;
+  samples = d.samples;
+  sampleSize = d.sampleSize;
+  classes = d.classes;
+  scale = d.scale;
+  shift = d.shift;
+  return *this;
+}
+
+void ByteDataset::setInputs(const uchar *data, int n, int size, bool copy) {
+  samples = n;
+  sampleSize = size;
+  if (copy) {
+    byteStore.assign(data, data+static_cast<size_t>(n)*size);
+    bytes = byteStore.data();
+  }
+  else {
+    byteStore.clear();
+    bytes = data;
+  }
+}
+
+void ByteDataset::setLabels(const uchar *data, int c, bool copy) {
+  classes = c;
+  if (copy) {
+    labelStore.assign(data, data+samples);
+    labels = labelStore.data();
+  }
+  else {
+    labelStore.clear();
+    labels = data;
+  }
+}
+
+/// Stage the samples sample(0), ..., sample(num-1)
+template<typename Index> void ByteDataset::gather(Index sample, int num, real *in, real *tar) const {
+  // Convert one sample at a time, while the next one is fetched (it need not follow this one in memory)
+  for (int j=0; j<num; j++) {
+    const uchar *x = getInput(sample(j));
+    if (j+1<num) {
+      const uchar *next = getInput(sample(j+1));
+      for (int i=0; i<sampleSize; i+=64) __builtin_prefetch(next+i);
+    }
+    for (int i=0; i<sampleSize; i++) in[i*num+j] = scale*x[i] + shift;
+  }
+  if (labels) {
+    memset(tar, 0, static_cast<size_t>(classes)*num*sizeof(real));
+    for (int j=0; j<num; j++)
+      if (labels[sample(j)]<classes) tar[labels[sample(j)]*num+j] = 1;
+  }
+  else for (int i=0; i<sampleSize*num; i++) tar[i] = in[i];
+}
+
+void ByteDataset::stage(int first, int num, real *in, real *tar) const {
+  gather([=] (int j) { return first+j; }, num, in, tar);
+}
+
+void ByteDataset::stage(const int *index, int num, real *in, real *tar) const {
+  gather([=] (int j) { return index[j]; }, num, in, tar);
+}
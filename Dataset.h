@@ -0,0 +1,87 @@
+/// Dataset.h - Training and test sets, staged into the network a minibatch at a time
+/// Nathaniel Rupprecht 2016
+///
+
+#ifndef DATASET_H
+#define DATASET_H
+
+#include "Tensor.h"
+
+typedef unsigned char uchar;
+
+/// A set of samples, each an input and a target. The network only ever asks for
+/// a minibatch of them at a time, laid out one sample per column, so a dataset
+/// can keep its samples in whatever form is most compact
+class Dataset {
+ public:
+  virtual ~Dataset() {};
+
+  virtual int size() const = 0;
+  virtual int inputSize() const = 0;
+  virtual int targetSize() const = 0;
+  /// Write samples [first, first+num) into the columns of in (inputSize x num) and
+  /// tar (targetSize x num), both row major
+  virtual void stage(int first, int num, real *in, real *tar) const = 0;
+  /// The same for samples index[0], ..., index[num-1], e.g. in a shuffled order
+  virtual void stage(const int *index, int num, real *in, real *tar) const = 0;
+};
+
+/// Samples kept as one tensor per input and one per target, as Network::setInputs
+/// and setTargets take them. It refers to the vectors, it does not copy them
+class TensorDataset : public Dataset {
+ public:
+  TensorDataset(const vector<Tensor*>& inputs, const vector<Tensor*>& targets) : inputs(&inputs), targets(&targets) {};
+
+  virtual int size() const { return inputs->size(); }
+  virtual int inputSize() const { return inputs->empty() ? 0 : inputs->at(0)->size(); }
+  virtual int targetSize() const { return targets->empty() ? 0 : targets->at(0)->size(); }
+  virtual void stage(int first, int num, real *in, real *tar) const;
+  virtual void stage(const int *index, int num, real *in, real *tar) const;
+
+ private:
+  template<typename Index> void gather(Index sample, int num, real *in, real *tar) const;
+
+  const vector<Tensor*> *inputs, *targets;
+};
+
+/// Samples kept as bytes (e.g. pixels) in one contiguous block, an eighth of the
+/// size of doubles. They are only converted to the compute type, as scale*byte +
+/// shift, when a minibatch is staged. The targets are one hot class labels, also
+/// bytes, or with no labels (for autoencoders) the inputs themselves. The bytes
+/// can be copied in or just referred to, e.g. in a memory mapped file
+class ByteDataset : public Dataset {
+ public:
+  ByteDataset() : bytes(0), labels(0), samples(0), sampleSize(0), classes(0), scale(1./255.), shift(0) {};
+  ByteDataset(const ByteDataset& d) { *this = d; }
+  ByteDataset& operator=(const ByteDataset& d);
+
+  /// Use n samples of sampleSize bytes each. If copy is false the bytes must outlive the dataset
+  void setInputs(const uchar *data, int n, int sampleSize, bool copy=true);
+  /// One label (below classes) per sample
+  void setLabels(const uchar *data, int classes, bool copy=true);
+  /// The inputs are scale*byte + shift, by default scaled to [0,1]
+  void setScale(real s, real sh=0) { scale = s; shift = sh; }
+
+  virtual int size() const { return samples; }
+  virtual int inputSize() const { return sampleSize; }
+  virtual int targetSize() const { return labels ? classes : sampleSize; }
+  virtual void stage(int first, int num, real *in, real *tar) const;
+  virtual void stage(const int *index, int num, real *in, real *tar) const;
+
+  const uchar* getInput(int i) const { return bytes+static_cast<size_t>(i)*sampleSize; }
+  int getLabel(int i) const { return labels[i]; }
+  bool hasLabels() const { return labels!=0; }
+  int getClasses() const { return classes; }
+  real getScale() const { return scale; }
+  real getShift() const { return shift; }
+
+ private:
+  template<typename Index> void gather(Index sample, int num, real *in, real *tar) const;
+
+  const uchar *bytes, *labels;
+  vector<uchar> byteStore, labelStore; // Our own copies, if we made them
+  int samples, sampleSize, classes;
+  real scale, shift;
+};
+
+#endif
@@ -0,0 +1,276 @@
+/// Gemm.cpp - The built-in gemm
+/// Nathaniel Rupprecht 2016
+///
+/// A packed-panel gemm in the style of GotoBLAS/BLIS. A (MC, KC) block of op(A)
+/// is packed into panels of MR rows and a (KC, NC) block of op(B) into panels of
+/// NR columns, so that a register-blocked micro-kernel can compute an (MR, NR)
+/// tile of C while streaming through contiguous memory. There are AVX-512,
+/// AVX2 and plain C++ micro-kernels for float and double, chosen at run time
+/// from what the CPU supports.
+///
+
+#include "Blas.h"
+
+#include <vector>
+using std::vector;
+#include <algorithm>
+using std::min;
+#include <string>
+using std::string;
+#include <stdlib.h> // For getenv
+
+#if (defined(__GNUC__) || defined(__INTEL_COMPILER)) && (defined(__x86_64__) || defined(__i386__))
+#define NN_GEMM_X86
+#include <immintrin.h>
+#endif
+
+// Block sizes. MC must be a multiple of every kernel's MR
+static const int MC = 96, KC = 256, NC = 2048;
+static const int maxTile = 8*32; // Largest MR*NR of any kernel
+
+/// A micro-kernel computes C[0:MR, 0:NR] += A panel * B panel, where the A panel holds
+/// kc columns of MR entries and the B panel kc rows of NR entries
+template<typename T> struct GemmKernel {
+  int MR, NR;
+  void (*kernel) (int kc, const T *a, const T *b, T *C, int ldc);
+};
+
+// --- Micro-kernels ---
+
+template<typename T, int MR, int NR> void kernelGeneric(int kc, const T *a, const T *b, T *C, int ldc) {
+  T acc[MR][NR] = {};
+  for (int p=0; p<kc; p++, a+=MR, b+=NR)
+    for (int i=0; i<MR; i++)
+      for (int j=0; j<NR; j++) acc[i][j] += a[i]*b[j];
+  for (int i=0; i<MR; i++)
+    for (int j=0; j<NR; j++) C[i*ldc+j] += acc[i][j];
+}
+
+#ifdef NN_GEMM_X86
+// 6x8 double tile, twelve 4-wide accumulators
+__attribute__((target("avx2,fma")))
+void kernelAVX2(int kc, const double *a, const double *b, double *C, int ldc) {
+  __m256d acc[6][2];
+  for (int i=0; i<6; i++) acc[i][0] = acc[i][1] = _mm256_setzero_pd();
+  for (int p=0; p<kc; p++, a+=6, b+=8) {
+    __m256d b0 = _mm256_loadu_pd(b), b1 = _mm256_loadu_pd(b+4);
+    for (int i=0; i<6; i++) { // Unrolled by the compiler, acc stays in registers
+      __m256d ai = _mm256_broadcast_sd(a+i);
+      acc[i][0] = _mm256_fmadd_pd(ai, b0, acc[i][0]);
+      acc[i][1] = _mm256_fmadd_pd(ai, b1, acc[i][1]);
+    }
+  }
+  for (int i=0; i<6; i++) {
+    double *c = &C[i*ldc];
+    _mm256_storeu_pd(c, _mm256_add_pd(_mm256_loadu_pd(c), acc[i][0]));
+    _mm256_storeu_pd(c+4, _mm256_add_pd(_mm256_loadu_pd(c+4), acc[i][1]));
+  }
+}
+
+// 6x16 float tile, twelve 8-wide accumulators
+__attribute__((target("avx2,fma")))
+void kernelAVX2(int kc, const float *a, const float *b, float *C, int ldc) {
+  __m256 acc[6][2];
+  for (int i=0; i<6; i++) acc[i][0] = acc[i][1] = _mm256_setzero_ps();
+  for (int p=0; p<kc; p++, a+=6, b+=16) {
+    __m256 b0 = _mm256_loadu_ps(b), b1 = _mm256_loadu_ps(b+8);
+    for (int i=0; i<6; i++) {
+      __m256 ai = _mm256_broadcast_ss(a+i);
+      acc[i][0] = _mm256_fmadd_ps(ai, b0, acc[i][0]);
+      acc[i][1] = _mm256_fmadd_ps(ai, b1, acc[i][1]);
+    }
+  }
+  for (int i=0; i<6; i++) {
+    float *c = &C[i*ldc];
+    _mm256_storeu_ps(c, _mm256_add_ps(_mm256_loadu_ps(c), acc[i][0]));
+    _mm256_storeu_ps(c+8, _mm256_add_ps(_mm256_loadu_ps(c+8), acc[i][1]));
+  }
+}
+
+// 8x16 double tile, sixteen 8-wide accumulators
+__attribute__((target("avx512f")))
+void kernelAVX512(int kc, const double *a, const double *b, double *C, int ldc) {
+  __m512d acc[8][2];
+  for (int i=0; i<8; i++) acc[i][0] = acc[i][1] = _mm512_setzero_pd();
+  for (int p=0; p<kc; p++, a+=8, b+=16) {
+    __m512d b0 = _mm512_loadu_pd(b), b1 = _mm512_loadu_pd(b+8);
+    for (int i=0; i<8; i++) {
+      __m512d ai = _mm512_set1_pd(a[i]);
+      acc[i][0] = _mm512_fmadd_pd(ai, b0, acc[i][0]);
+      acc[i][1] = _mm512_fmadd_pd(ai, b1, acc[i][1]);
+    }
+  }
+  for (int i=0; i<8; i++) {
+    double *c = &C[i*ldc];
+    _mm512_storeu_pd(c, _mm512_add_pd(_mm512_loadu_pd(c), acc[i][0]));
+    _mm512_storeu_pd(c+8, _mm512_add_pd(_mm512_loadu_pd(c+8), acc[i][1]));
+  }
+}
+
+// 8x32 float tile, sixteen 16-wide accumulators
+__attribute__((target("avx512f")))
+void kernelAVX512(int kc, const float *a, const float *b, float *C, int ldc) {
+  __m512 acc[8][2];
+  for (int i=0; i<8; i++) acc[i][0] = acc[i][1] = _mm512_setzero_ps();
+  for (int p=0; p<kc; p++, a+=8, b+=32) {
+    __m512 b0 = _mm512_loadu_ps(b), b1 = _mm512_loadu_ps(b+16);
+    for (int i=0; i<8; i++) {
+      __m512 ai = _mm512_set1_ps(a[i]);
+      acc[i][0] = _mm512_fmadd_ps(ai, b0, acc[i][0]);
+      acc[i][1] = _mm512_fmadd_ps(ai, b1, acc[i][1]);
+    }
+  }
+  for (int i=0; i<8; i++) {
+    float *c = &C[i*ldc];
+    _mm512_storeu_ps(c, _mm512_add_ps(_mm512_loadu_ps(c), acc[i][0]));
+    _mm512_storeu_ps(c+16, _mm512_add_ps(_mm512_loadu_ps(c+16), acc[i][1]));
+  }
+}
+#endif
+
+// Kernel levels, in the order they are tried
+enum KernelLevel { Generic, AVX2, AVX512 };
+static const char* levelNames[] = { "generic", "avx2", "avx512" };
+
+/// Find the best kernel level the CPU supports. Setting the environment variable
+/// NN_GEMM_KERNEL to generic or avx2 caps the choice, e.g. for benchmarking
+static KernelLevel findLevel() {
+#ifdef NN_GEMM_X86
+  const char *cap = getenv("NN_GEMM_KERNEL");
+  string limit = cap ? cap : "";
+  if (limit=="generic") return Generic;
+  if (limit!="avx2" && __builtin_cpu_supports("avx512f")) return AVX512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return AVX2;
+#endif
+  return Generic;
+}
+
+static KernelLevel kernelLevel() {
+  static const KernelLevel level = findLevel(); // Only decide once
+  return level;
+}
+
+const char* builtinGemmKernel() {
+  return levelNames[kernelLevel()];
+}
+
+template<typename T> const GemmKernel<T>& selectKernel();
+
+template<> const GemmKernel<double>& selectKernel<double>() {
+  static const GemmKernel<double> kernels[] = {
+    { 4, 4, kernelGeneric<double,4,4> },
+#ifdef NN_GEMM_X86
+    { 6, 8, kernelAVX2 },
+    { 8, 16, kernelAVX512 },
+#endif
+  };
+  return kernels[kernelLevel()];
+}
+
+template<> const GemmKernel<float>& selectKernel<float>() {
+  static const GemmKernel<float> kernels[] = {
+    { 4, 8, kernelGeneric<float,4,8> },
+#ifdef NN_GEMM_X86
+    { 6, 16, kernelAVX2 },
+    { 8, 32, kernelAVX512 },
+#endif
+  };
+  return kernels[kernelLevel()];
+}
+
+// --- Packing ---
+
+/// Pack alpha * op(A)[ic:ic+mc, pc:pc+kc] into panels of MR rows, padding with zeros
+template<typename T> void packA(BlasTranspose TA, const T *A, int lda, int ic, int pc, int mc, int kc,
+				T alpha, int MR, T *pack) {
+  for (int ir=0; ir<mc; ir+=MR, pack+=MR*kc) {
+    int mr = min(MR, mc-ir);
+    for (int p=0; p<kc; p++) {
+      T *dst = &pack[p*MR];
+      int i = 0;
+      if (TA==BlasNoTrans)
+	for (const T *src = &A[(ic+ir)*lda+pc+p]; i<mr; i++) dst[i] = alpha*src[i*lda];
+      else
+	for (const T *src = &A[(pc+p)*lda+ic+ir]; i<mr; i++) dst[i] = alpha*src[i];
+      for (; i<MR; i++) dst[i] = 0;
+    }
+  }
+}
+
+/// Pack op(B)[pc:pc+kc, jc:jc+nc] into panels of NR columns, padding with zeros
+template<typename T> void packB(BlasTranspose TB, const T *B, int ldb, int pc, int jc, int kc, int nc,
+				int NR, T *pack) {
+  for (int jr=0; jr<nc; jr+=NR, pack+=NR*kc) {
+    int nr = min(NR, nc-jr);
+    for (int p=0; p<kc; p++) {
+      T *dst = &pack[p*NR];
+      int j = 0;
+      if (TB==BlasNoTrans)
+	for (const T *src = &B[(pc+p)*ldb+jc+jr]; j<nr; j++) dst[j] = src[j];
+      else
+	for (const T *src = &B[(jc+jr)*ldb+pc+p]; j<nr; j++) dst[j] = src[j*ldb];
+      for (; j<NR; j++) dst[j] = 0;
+    }
+  }
+}
+
+// --- Driver ---
+
+template<typename T> void gemmDriver(BlasTranspose TA, BlasTranspose TB, int m, int n, int k, T alpha, const T *A, int lda,
+				     const T *B, int ldb, T beta, T *C, int ldc) {
+  // C = beta * C
+  for (int i=0; i<m; i++) {
+    T *c = &C[i*ldc];
+    if (beta==0) for (int j=0; j<n; j++) c[j] = 0;
+    else if (beta!=1) for (int j=0; j<n; j++) c[j] *= beta;
+  }
+  if (alpha==0 || k==0 || m==0 || n==0) return;
+
+  const GemmKernel<T>& K = selectKernel<T>();
+  const int MR = K.MR, NR = K.NR;
+  // Packing buffers are kept between calls so small products do not allocate
+  static thread_local vector<T> aPack, bPack;
+  int mcMax = min(MC, m), kcMax = min(KC, k), ncMax = min(NC, n);
+  aPack.resize(((mcMax+MR-1)/MR)*MR*kcMax);
+  bPack.resize(((ncMax+NR-1)/NR)*NR*kcMax);
+  T edge[maxTile]; // Holds an (MR, NR) tile that hangs off the edge of C
+
+  for (int jc=0; jc<n; jc+=NC) {
+    int nc = min(NC, n-jc);
+    for (int pc=0; pc<k; pc+=KC) {
+      int kc = min(KC, k-pc);
+      packB(TB, B, ldb, pc, jc, kc, nc, NR, bPack.data());
+      for (int ic=0; ic<m; ic+=MC) {
+	int mc = min(MC, m-ic);
+	packA(TA, A, lda, ic, pc, mc, kc, alpha, MR, aPack.data());
+	// Loop over the (MR, NR) tiles of this block of C
+	for (int jr=0; jr<nc; jr+=NR) {
+	  int nr = min(NR, nc-jr);
+	  const T *b = &bPack[jr*kc];
+	  for (int ir=0; ir<mc; ir+=MR) {
+	    int mr = min(MR, mc-ir);
+	    const T *a = &aPack[ir*kc];
+	    T *c = &C[(ic+ir)*ldc+jc+jr];
+	    if (mr==MR && nr==NR) K.kernel(kc, a, b, c, ldc);
+	    else {
+	      for (int i=0; i<MR*NR; i++) edge[i] = 0;
+	      K.kernel(kc, a, b, edge, NR);
+	      for (int i=0; i<mr; i++)
+		for (int j=0; j<nr; j++) c[i*ldc+j] += edge[i*NR+j];
+	    }
+	  }
+	}
+      }
+    }
+  }
+}
+
+void builtinGemm(BlasTranspose TA, BlasTranspose TB, int m, int n, int k, double alpha, const double *A, int lda,
+		 const double *B, int ldb, double beta, double *C, int ldc) {
+  gemmDriver(TA, TB, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+}
+
+void builtinGemm(BlasTranspose TA, BlasTranspose TB, int m, int n, int k, float alpha, const float *A, int lda,
+		 const float *B, int ldb, float beta, float *C, int ldc) {
+  gemmDriver(TA, TB, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+}
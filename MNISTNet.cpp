@@ -3,6 +3,7 @@
 ///
 
 #include "Network.h"
+#include "Optimizer.h"
 #include "MNISTUnpack.h"
 
 int main(int argc, char* argv[]) {
@@ -13,17 +14,12 @@ int main(int argc, char* argv[]) {
   MPI_Comm_size( MPI_COMM_WORLD, &size );
 
   // Get the training data
+  // The images stay as bytes in the mapped files, normalized as each minibatch is staged
   FileUnpack unpacker("MNISTData/MNIST_trainingImages","MNISTData/MNIST_trainingLabels");
   unpacker.unpackInfo();
-  vector<Tensor*> inputs, targets;
-  inputs = unpacker.getImages();
-  targets = unpacker.getLabels();
   
   FileUnpack testUnpacker("MNISTData/MNIST_testImages", "MNISTData/MNIST_testLabels");
   testUnpacker.unpackInfo();
-  vector<Tensor*> testInputs, testTargets;
-  testInputs = testUnpacker.getImages();
-  testTargets = testUnpacker.getLabels();
 
   Network net;
   vector<int> neurons;
@@ -35,16 +31,28 @@ int main(int argc, char* argv[]) {
   
   net.setRate(0.1);
   net.setL2const(0.);  
-  net.createFeedForward(neurons, sigmoid, dsigmoid);
+  net.createFeedForward(neurons, ActSigmoid);
 
-  net.setInputs(inputs);
-  net.setTargets(targets);
-
-  net.setTestInputs(testInputs);
-  net.setTestTargets(testTargets);
+  net.setTrainingSet(unpacker.getDataset());
+  net.setTestSet(testUnpacker.getDataset());
+  net.setShuffle(true); // A new sample order every iteration
 
   net.setMinibatch(50);
+  // Usage: MNISTNet [threads] [sync|hogwild] [sgd|momentum|nesterov|rmsprop|adam]
+  if (argc>1) net.setThreads(atoi(argv[1])); // Threads per process
+  if (argc>2 && string(argv[2])=="hogwild") net.setTrainingMode(HogwildTraining);
+  if (argc>3) {
+    Optimizer *opt = createOptimizer(argv[3]);
+    if (opt==0) {
+      if (rank==0) cout << "Unknown optimizer \"" << argv[3] << "\", use sgd, momentum, nesterov, rmsprop or adam." << endl;
+      MPI_Finalize();
+      return 1;
+    }
+    net.setOptimizer(opt);
+  }
   net.setTrainingIters(50);
+  net.setEarlyStopping(5); // Stop once the test set score stops improving
+  net.setKeepBest(true);
   net.setCalcError(true);
   net.setDisplay(false);
 
@@ -55,13 +63,10 @@ int main(int argc, char* argv[]) {
     cout << "errRec=" << print(net.getErrorRec()) << ";\n";
     cout << "trainCorrect=" << print(net.getTrainPercentRec()) << ";\n";
     cout << "aveTime=" << net.getAveTime() << ";\n";
+    cout << "samplesPerSec=" << print(net.getSamplesPerSecRec()) << ";\n";
+    cout << "gflops=" << print(net.getGflopsRec()) << ";\n";
     cout << "errVtime=" << print(net.getErrVTime()) << ";\n";
   }
-  
-  for (auto p : inputs) delete p;
-  for (auto p : targets) delete p;
-  for (auto p : testInputs) delete p;
-  for (auto p : testTargets) delete p;  
 
   // End MPI
   MPI_Finalize();
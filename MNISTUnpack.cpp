@@ -5,104 +5,145 @@
 #include "MNISTUnpack.h"
 
 #include <stdint.h>
+#include <limits.h>   // For INT_MAX
+#include <fcntl.h>    // For open
+#include <unistd.h>   // For close
+#include <sys/mman.h> // For mmap
+#include <sys/stat.h> // For fstat
 
 #include <iostream>
 using std::cout;
 using std::endl;
 
-FileUnpack::FileUnpack(string imageFileName, string labelFileName) {
+FileUnpack::FileUnpack(string imageFileName, string labelFileName) : rows(0), cols(0) {
   this->imageFileName = imageFileName;
   this->labelFileName = labelFileName;
 }
 
-void FileUnpack::unpackInfo() {
-  ifstream ifin(imageFileName);
-  if(ifin.fail()) {
-    cout << "File " << imageFileName << " failed to open." << endl;
-    return;
+IdxFile::IdxFile(const string& fileName) : map(0), length(0), body(0), type(0) {
+  open(fileName);
+}
+
+IdxFile::~IdxFile() {
+  close();
+}
+
+/// The header is two zero bytes, the type, the number of dimensions, then each
+/// dimension as a big endian 32 bit integer
+bool IdxFile::open(const string& fileName) {
+  close();
+  int fd = ::open(fileName.c_str(), O_RDONLY);
+  if (fd<0) {
+    cout << "File " << fileName << " failed to open." << endl;
+    return false;
   }
-  ifstream lfin(labelFileName);
-  if(lfin.fail()) {
-    cout << "File " << labelFileName << " failed to open." << endl;
-    return;
+  struct stat info;
+  if (fstat(fd, &info)==0 && info.st_size>=4) {
+    length = info.st_size;
+    map = mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map==MAP_FAILED) map = 0;
   }
-
-  int magicnum, rows, cols;
-    
-  // First, unpack images
-  // Get the first four numbers
-  magicnum = getI32(ifin);    // Get the magic number
-  getI32(ifin);      // Try to get the number of items
-  rows = getI32(ifin);
-  cols = getI32(ifin);
-    
-  if(magicnum != 2051) // Not really the image file
-    throw 2;
-    
-  int bytes = rows*cols;
-  char ubyte; // An unsigned byte
-  
-  vector<uchar*> img;
-  while(!ifin.eof()) { // Read to the end of the file
-    uchar *array = new uchar[bytes];
-    for(int i=0; i<bytes; i++) {
-      ifin.get(ubyte);
-      array[i] = ubyte;
-    }
-    img.push_back(array);
-  } // EOF
-  img.pop_back(); // The last "image" isn't really an image
-    
-  // Convert img images to Tensor form
-  for (int i=0; i<img.size(); i++) {
-    Tensor *M = new Tensor(bytes,1);
-    for (int j=0; j<bytes; j++)
-      M->at(j,0) = static_cast<double>(img.at(i)[j]/255.);
-    images.push_back(M);
+  ::close(fd); // The mapping stays valid
+  if (!map) {
+    cout << "File " << fileName << " could not be mapped." << endl;
+    return false;
   }
-
-  // Now, unpack labels
-  magicnum = getI32(lfin); // Get the magic number
-  if(magicnum != 2049) {
-    // Not really the label file
-    throw 2;
+  const uchar *bytes = static_cast<const uchar*>(map);
+  int nDims = bytes[3];
+  size_t header = 4+4*nDims, entries = 1;
+  if (bytes[0]!=0 || bytes[1]!=0 || header>length) {
+    cout << "File " << fileName << " is not an IDX file." << endl;
+    close();
+    return false;
+  }
+  type = bytes[2];
+  for (int d=0; d<nDims; d++) {
+    const uchar *b = bytes+4+4*d;
+    // Big endian. Shift unsigned values, since a byte promoted to int can't take the top bit
+    uint32_t n = (uint32_t(b[0])<<24) | (uint32_t(b[1])<<16) | (uint32_t(b[2])<<8) | uint32_t(b[3]);
+    dims.push_back(n>INT_MAX ? INT_MAX : n);
+    entries = n==0 || entries<=length/n ? entries*n : length+1; // Any size past the file is rejected below
   }
-  getI32(lfin); // Try to get the number of items
-  vector<uchar> lbl;
-  while(!lfin.eof()) {
-    lfin.get(ubyte);
-    lbl.push_back(ubyte);
+  body = bytes+header;
+  if (type!=0x08 || header+entries>length) {
+    cout << "File " << fileName << " is truncated or does not hold unsigned bytes." << endl;
+    close();
+    return false;
   }
-  lbl.pop_back(); // The last label isn't really a label
-  
-  // Convert lbl lables to Tensor form
-  for (int i=0; i<lbl.size(); i++) {
-    Tensor* M = new Tensor(10,1);
-    for (int j=0; j<10; j++) {
-      if (j==(int)lbl.at(i)) M->at(j,0) = 1;
-      else M->at(j,0) = 0;
+  // We read it front to back
+  madvise(map, length, MADV_SEQUENTIAL);
+  return true;
+}
+
+void IdxFile::close() {
+  if (map) munmap(map, length);
+  map = 0;
+  length = 0;
+  body = 0;
+  type = 0;
+  dims.clear();
+}
+
+int IdxFile::itemSize() const {
+  int n = 1;
+  for (int d=1; d<dims.size(); d++) n *= dims[d];
+  return n;
+}
+
+void FileUnpack::unpackInfo() {
+  if (!imageFile.open(imageFileName) || !labelFile.open(labelFileName)) return;
+  // Images are items x rows x cols, labels just items
+  if (imageFile.getDims().size()!=3 || labelFile.getDims().size()!=1 || imageFile.items()!=labelFile.items())
+    throw 2; // Not really the image and label files
+  rows = imageFile.getDims()[1];
+  cols = imageFile.getDims()[2];
+  images.clear();
+  labels.clear();
+  // The dataset uses the mapped bytes as they are
+  dataset.setInputs(imageFile.data(), imageFile.items(), imageFile.itemSize(), false);
+  dataset.setLabels(labelFile.data(), 10, false);
+}
+
+vector<Tensor*> FileUnpack::getImages() {
+  if (images.empty() && dataset.size()>0) {
+    // Scale all the images in one pass, then make each a view
+    int N = dataset.size(), bytes = dataset.inputSize();
+    imageData.resize(static_cast<size_t>(N)*bytes);
+    const uchar *img = dataset.getInput(0);
+    real scale = 1./255.;
+    for (size_t j=0; j<imageData.size(); j++) imageData[j] = scale*img[j];
+    for (int i=0; i<N; i++) {
+      Tensor *M = new Tensor;
+      M->view(&imageData[static_cast<size_t>(i)*bytes], Shape(bytes, 1));
+      images.push_back(M);
     }
-    labels.push_back(M);
   }
+  return images;
 }
 
-uint FileUnpack::getI32(ifstream& fin) {
-  char n1, n2, n3, n4;
-  fin >> n1;
-  fin >> n2;
-  fin >> n3;
-  fin >> n4;
-    
-  return (uint)n4 + (((uint)n3)<<8) + (((uint)n2) << 16) + (((uint)n1) << 24);
+vector<Tensor*> FileUnpack::getLabels() {
+  if (labels.empty() && dataset.size()>0) {
+    // One hot labels
+    int N = dataset.size();
+    labelData.assign(10*N, 0);
+    for (int i=0; i<N; i++) {
+      if (dataset.getLabel(i)<10) labelData[10*i+dataset.getLabel(i)] = 1;
+      Tensor *M = new Tensor;
+      M->view(&labelData[10*i], Shape(10, 1));
+      labels.push_back(M);
+    }
+  }
+  return labels;
 }
 
 BMP FileUnpack::getImage(uint index) {
   BMP image;
-  image.SetSize(28, 28);
+  image.SetSize(cols, rows);
+  const uchar *img = dataset.getInput(index);
     
-  for(int y=0; y<28; y++)
-    for(int x=0; x<28; x++) {
-      int col = 255 - images.at(index)->at(28*y+x,1); //** Is this correct?
+  for(int y=0; y<rows; y++)
+    for(int x=0; x<cols; x++) {
+      int col = 255-img[cols*y+x]; // Dark digits on white
       image.SetPixel(x, y, RGBApixel(col, col, col));
     }
     
@@ -110,6 +151,7 @@ BMP FileUnpack::getImage(uint index) {
 }
 
 Tensor& FileUnpack::getLabel(uint index) {
+  getLabels();
   return *labels.at(index);
 }
 
@@ -118,4 +160,7 @@ void FileUnpack::setFileNames(string image, string label) {
   labelFileName=label;
   images.clear();
   labels.clear();
+  dataset = ByteDataset();
+  imageFile.close();
+  labelFile.close();
 }
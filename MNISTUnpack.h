@@ -15,13 +15,55 @@ using std::vector;
 
 #include "EasyBMP/EasyBMP.h"
 #include "Tensor.h"
+#include "Dataset.h"
 
 typedef unsigned int uint;
 typedef unsigned char uchar;
 
+/// A file in the IDX format that MNIST comes in, memory mapped. The header gives
+/// the element type and the dimensions, the first of which counts the items. The
+/// items follow as one contiguous block of bytes, so they are read straight out
+/// of the page cache without any copying
+class IdxFile {
+ public:
+  IdxFile() : map(0), length(0), body(0), type(0) {};
+  IdxFile(const string& fileName);
+  ~IdxFile();
+
+  /// Map a file, returns false (and prints why) if it can't be opened or isn't IDX
+  bool open(const string& fileName);
+  void close();
+
+  bool isOpen() const { return map!=0; }
+  int getType() const { return type; } // 0x08 for unsigned bytes
+  const vector<int>& getDims() const { return dims; }
+  int items() const { return dims.empty() ? 0 : dims[0]; }
+  int itemSize() const; // Entries per item, the product of the other dimensions
+  /// The unsigned byte entries, item after item
+  const uchar* data() const { return body; }
+  const uchar* item(int i) const { return body+i*itemSize(); }
+
+ private:
+  IdxFile(const IdxFile&);            // Not copyable, it owns the mapping
+  IdxFile& operator=(const IdxFile&);
+
+  void *map;     // The mapping of the whole file
+  size_t length;
+  const uchar *body;
+  int type;
+  vector<int> dims;
+};
+
+/// Unpacks the MNIST images and labels. The files stay mapped, and getDataset
+/// serves the training samples straight from their bytes, scaled to [0,1] a
+/// minibatch at a time. getImages and getLabels instead give each image (scaled)
+/// and label (one hot) as a tensor, made on first use as views of one contiguous
+/// array for all images and one for all labels. Either way the data belongs to
+/// the FileUnpack, so it must outlive the dataset and the tensors (which the
+/// caller deletes)
 class FileUnpack {
  public:
-  FileUnpack() {};
+  FileUnpack() : rows(0), cols(0) {};
   FileUnpack(string imageFileName, string labelFileName);
     
   void unpackInfo();
@@ -30,22 +72,26 @@ class FileUnpack {
   Tensor& getLabel(uint index);
     
   // Accessors
-  vector<Tensor*> getImages() {return images;}
-  vector<Tensor*> getLabels() {return labels;}
+  const ByteDataset& getDataset() const { return dataset; }
+  vector<Tensor*> getImages();
+  vector<Tensor*> getLabels();
     
   // Mutators
   void setFileNames(string image, string label);
     
  private:
     
-  uint getI32(ifstream& fin);
-    
   string imageFileName;
   string labelFileName;
+  int rows, cols; // Image size
+  IdxFile imageFile, labelFile;
+  ByteDataset dataset;
     
   // Unpacked info vectors
   vector<Tensor*> images;  // Vector of images
   vector<Tensor*> labels;   // Vector of labels
+  vector<real> imageData;  // All the images, one after the other
+  vector<real> labelData;  // All the labels
 };
 
 #endif // MNIST_UNPACK_H
@@ -35,10 +35,10 @@ void multiply(const Matrix& A, const Matrix& B, Matrix& C) {
   if (A.getCols()!=B.getRows() || A.getRows()!=C.getRows() || B.getCols()!=C.getCols())
     throw Matrix::MatrixMismatch();
 
-  auto AT = A.trans ? CblasTrans : CblasNoTrans;
-  auto BT = B.trans ? CblasTrans : CblasNoTrans;
+  BlasTranspose AT = A.trans ? BlasTrans : BlasNoTrans;
+  BlasTranspose BT = B.trans ? BlasTrans : BlasNoTrans;
   double ALPHA = 1, BETA = 0;
-  cblas_dgemm(CblasRowMajor, AT, BT, A.getRows(), B.getCols(), A.getCols(), ALPHA, A.array, A.getACols(), B.array, B.getACols(), BETA, C.array, C.getCols());
+  gemm(AT, BT, A.getRows(), B.getCols(), A.getCols(), ALPHA, A.array, A.getACols(), B.array, B.getACols(), BETA, C.array, C.getCols());
 }
 
 void multiply(const double m, const Matrix& A, Matrix& B) {
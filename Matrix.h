@@ -7,6 +7,11 @@
 
 #include "Utility.h"
 
+// Default arguments can only be given outside of friend declarations
+class Matrix;
+void NTplusEqUnsafe(Matrix& A, const Matrix& B, double mult=1.);
+void NTminusEqUnsafe(Matrix& A, const Matrix& B, double mult=1.);
+
 class Matrix {
  public:
   Matrix();
@@ -23,10 +28,10 @@ class Matrix {
   friend void timesEq(Matrix& A, const double m);
   friend void add(const Matrix& A, const Matrix& B, Matrix& C);
   friend void plusEq(Matrix& A, const Matrix& B);
-  friend void NTplusEqUnsafe(Matrix& A, const Matrix& B, double mult=1.);
+  friend void NTplusEqUnsafe(Matrix& A, const Matrix& B, double mult);
   friend void subtract(const Matrix& A, const Matrix& B, Matrix& C);
   friend void minusEq(Matrix& A, const Matrix& B);
-  friend void NTminusEqUnsafe(Matrix& A, const Matrix& B, double mult=1.);
+  friend void NTminusEqUnsafe(Matrix& A, const Matrix& B, double mult);
   friend void hadamard(const Matrix& A, const Matrix& B, Matrix& C);
   friend void apply(const Matrix& A, function F, Matrix& C); // Apply F componentwise to A
 
@@ -4,10 +4,33 @@
 
 #include "Network.h"
 
+#include <stdlib.h> // For posix_memalign
+#include <string.h> // For memset and memcpy
+#include <algorithm>
+#include <numeric> // For iota
+#include <random>
+
 // Squaring function
 inline double sqr(double x) { return x*x; }
 
-Network::Network() : initialized(false), aout(0), zout(0), deltas(0), trainMarker(0), total(0), fnct(0), dfnct(0), rate(0.01), factor(0.), L2const(0.), L2factor(0.), trainingIters(100), minibatch(10), display(true), doTest(true), checkCorrect(true), calcError(true), testCorrect(0), rank(0), size(1) {
+// Every tensor in an arena starts on its own cache line
+const int arenaAlign = 64;
+
+/// Round n entries up to whole cache lines
+inline int alignEntries(int n) {
+  const int k = arenaAlign/sizeof(real);
+  return (n+k-1)/k*k;
+}
+
+/// Allocate n zeroed, cache line aligned entries. Release them with free()
+inline real* newArena(int n) {
+  void *p = 0;
+  if (posix_memalign(&p, arenaAlign, max(n,1)*sizeof(real))) throw std::bad_alloc();
+  memset(p, 0, n*sizeof(real));
+  return static_cast<real*>(p);
+}
+
+Network::Network() : initialized(false), trainMarker(0), params(0), paramSize(0), gradSize(0), optimizer(new SGD), nThreads(1), pool(0), mode(SyncTraining), bucketSize(1<<21), commTime(0), overlapComm(true), overlapping(false), total(0), rate(0.01), iterRate(0.01), schedule(ConstantRate), rateStep(10), rateDecay(0.1), warmupIters(0), factor(0.), L2const(0.), trainingIters(100), minibatch(10), profiling(false), patience(0), keepBest(false), bestIter(0), bestTest(0), bestParams(0), display(true), doTest(true), tensorTrain(inputs, targets), tensorTest(testInputs, testTargets), trainSet(0), testSet(0), prefetch(false), prefetching(false), shuffle(false), shuffleSeed(1), checkCorrect(true), calcError(true), testCorrect(0), rank(0), size(1) {
   //MPI_Init(&argc, &argv);
   MPI_Comm_rank( MPI_COMM_WORLD, &rank );
   MPI_Comm_size( MPI_COMM_WORLD, &size );
@@ -15,12 +38,17 @@ Network::Network() : initialized(false), aout(0), zout(0), deltas(0), trainMarke
 
 Network::~Network() {
   deleteArrays();
+  delete optimizer;
 }
 
 inline void Network::deleteArrays() {
-  if (aout) delete [] aout;
-  if (zout) delete [] zout;
-  if (deltas) delete [] deltas;
+  deleteWorkers();
+  for (auto w : work) delete w;
+  work.clear();
+  if (params) free(params);
+  params = 0;
+  if (bestParams) free(bestParams);
+  bestParams = 0;
   if (trainMarker) delete [] trainMarker;
 }
 
@@ -30,19 +58,11 @@ inline void Network::createArrays(vector<int>& neurons) {
   layers = new Neuron*[total];
   
   // Create Tensor arrays
-  aout = new Tensor[total];
-  zout = new Tensor[total];
-  deltas = new Tensor[total];
+  work.push_back(new Workspace(total, layers));
   trainMarker = new bool[total];
 
   // Set vector/matrix sizes
-  aout[0].resize(neurons.at(0), 1);
-  zout[0].resize(neurons.at(0), 1);
-  for (int i=1; i<total; i++) {
-    aout[i].resize(neurons.at(i), 1);
-    zout[i].resize(neurons.at(i), 1);
-    deltas[i].resize(neurons.at(i), 1);
-  }
+  setBatchCols(*work[0], 1);
   // Set trainMarker array
   for (int i=0; i<total; i++) trainMarker[i] = true;
 }
@@ -54,11 +74,14 @@ void Network::printDescription() {
     if (i!=total-1) cout << " --> ";
   }
   cout << endl;
-  cout << "Using " << size << " processes." << endl;
-  cout << "Minibatch size " << minibatch << ", Rate " << rate << endl;
+  cout << "Activations:";
+  for (int i=1; i<total; i++) cout << " " << activationName(layers[i]->getActivation());
+  cout << endl;
+  cout << "Using " << size << " processes, " << nThreads << " threads each." << endl;
+  cout << "Minibatch size " << minibatch << ", Rate " << rate << ", Optimizer " << optimizer->name() << endl;
 }
 
-void Network::createFeedForward(vector<int>& neurons, function F, function DF) {
+void Network::createFeedForward(vector<int>& neurons, ActivationType type) {
   deleteArrays();
   createArrays(neurons);
   // Set up layers
@@ -67,19 +90,161 @@ void Network::createFeedForward(vector<int>& neurons, function F, function DF) {
     Shape in_v(neurons.at(i-1), 1);
     Shape out_v(neurons.at(i), 1);
     layers[i] = new Sigmoid(in_v, out_v);
+    layers[i]->setActivation(type);
   }
+  createArenas();
 
   // The network has been initialized
   initialized = true;
 }
 
+void Network::setActivation(ActivationType type, int layer) {
+  if (!initialized) return;
+  for (auto w : work) {
+    if (layer<0) for (int i=1; i<total; i++) w->layers[i]->setActivation(type);
+    else if (0<layer && layer<total) w->layers[layer]->setActivation(type);
+  }
+}
+
+void Network::setCacheDerivatives(bool c) {
+  if (!initialized) return;
+  for (auto w : work)
+    for (int i=1; i<total; i++) w->layers[i]->setCacheDerivative(c);
+}
+
+/// Move the weights and biases of all the layers into one arena, with their
+/// gradients at the same offsets of another, layer by layer, so the optimizer
+/// can update each tensor in one pass. The layers' tensors become views into
+/// the arenas. A weight tensor shared by tied layers is only stored at its first
+/// place; the gradient at the second place is folded into the first one
+inline void Network::createArenas() {
+  gradOffset.assign(total+1, 0);
+  gradSize = 0;
+  for (int i=1; i<total; i++) {
+    gradOffset[i] = gradSize;
+    for (auto T : layers[i]->getCommon()) gradSize += alignEntries(T->size());
+  }
+  gradOffset[total] = paramSize = gradSize;
+  params = newArena(paramSize);
+  segments.clear();
+  folds.clear();
+  vector<Tensor*> placed;
+  vector<int> placedAt;
+  for (int i=1; i<total; i++) {
+    vector<Tensor*> P = layers[i]->getParameters(), G = layers[i]->getCommon();
+    int offset = gradOffset[i];
+    for (int k=0; k<P.size(); k++) {
+      Tensor *T = P[k];
+      int n = T->size(), p = std::find(placed.begin(), placed.end(), T)-placed.begin();
+      if (p==placed.size()) {
+	real *a = params+offset;
+	const real *x = T->getArray();
+	for (int j=0; j<n; j++) a[j] = x[j];
+	T->view(a, T->getShape());
+	placed.push_back(T);
+	placedAt.push_back(offset);
+	segments.push_back(Segment{i, offset, n, k==0});
+      }
+      else folds.push_back(Fold{offset, placedAt[p], G[k]->getRows(), G[k]->getCols(), layers[i]->transposedGradient(k)});
+      offset += alignEntries(n);
+    }
+  }
+  layoutGradients(*work[0]);
+  optimizer->setSize(paramSize);
+}
+
+/// Give a workspace its own (zeroed) gradient arena, laid out as gradOffset says
+inline void Network::layoutGradients(Workspace& w) {
+  if (w.grads) free(w.grads);
+  w.grads = newArena(gradSize);
+  for (int i=1; i<total; i++) {
+    int offset = gradOffset[i];
+    for (auto T : w.layers[i]->getCommon()) {
+      T->view(w.grads+offset, T->getShape());
+      offset += alignEntries(T->size());
+    }
+  }
+}
+
 void Network::createCommonTensorPool() {
+  commonTensors.clear();
   for (int i=1; i<total; i++)
     for (auto T : layers[i]->getCommon())
       commonTensors.push_back(T);
+  // Split the gradient arena at tensor boundaries into buckets of at least bucketSize entries (the last may be smaller)
+  buckets.clear();
+  int first = 0;
+  for (int k=0; k<commonTensors.size(); k++) {
+    int end = k+1<commonTensors.size() ? commonTensors[k+1]->getArray()-work[0]->grads : gradSize;
+    if (end-first>=bucketSize || k==commonTensors.size()-1) {
+      buckets.push_back(pair<int,int>(first, end));
+      first = end;
+    }
+  }
+}
+
+/// Sum the gradients over all the processes, with one allreduce per bucket
+inline void Network::allreduceGradients() {
+  double start = MPI_Wtime(), begin = prof.start();
+  real *grads = work[0]->grads;
+  for (auto& B : buckets)
+    MPI_Allreduce(MPI_IN_PLACE, grads+B.first, B.second-B.first, MPI_NN_REAL, MPI_SUM, MPI_COMM_WORLD);
+  prof.stop(CommPhase, 0, begin);
+  commTime += MPI_Wtime()-start;
+}
+
+/// Start summing layer [j]'s gradients over all the processes, while the
+/// backward pass goes on with the layers below
+inline void Network::startAllreduce(int j) {
+  double begin = prof.start();
+  MPI_Request request;
+  real *grads = work[0]->grads+gradOffset[j];
+  MPI_Iallreduce(MPI_IN_PLACE, grads, gradOffset[j+1]-gradOffset[j], MPI_NN_REAL, MPI_SUM, MPI_COMM_WORLD, &request);
+  requests.push_back(request);
+  // Most MPI libraries only make progress on a collective inside MPI calls
+  int flag;
+  MPI_Testall(requests.size(), requests.data(), &flag, MPI_STATUSES_IGNORE);
+  prof.stop(CommPhase, j, begin);
 }
 
-void Network::createAutoEncoder(vector<int>& neur, function F, function DF) {
+/// Wait for the allreduces started during the backward pass
+inline void Network::waitAllreduce() {
+  double start = MPI_Wtime(), begin = prof.start();
+  MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+  requests.clear();
+  prof.stop(CommPhase, 0, begin);
+  commTime += MPI_Wtime()-start;
+}
+
+/// Set up the thread pool and one workspace per thread. The other threads train
+/// with replicas of the layers, which share the weights and biases
+inline void Network::createWorkers() {
+  if (pool && pool->size()==nThreads) return;
+  deleteWorkers();
+  for (int t=1; t<nThreads; t++) {
+    Workspace *w = new Workspace(total, new Neuron*[total], t);
+    w->layers[0] = 0;
+    for (int i=1; i<total; i++) w->layers[i] = layers[i]->replicate();
+    layoutGradients(*w);
+    setBatchCols(*w, 1);
+    work.push_back(w);
+  }
+  pool = new ThreadPool(nThreads);
+}
+
+inline void Network::deleteWorkers() {
+  while (work.size()>1) {
+    Workspace *w = work.back();
+    for (int i=1; i<total; i++) delete w->layers[i];
+    delete [] w->layers;
+    delete w;
+    work.pop_back();
+  }
+  if (pool) delete pool;
+  pool = 0;
+}
+
+void Network::createAutoEncoder(vector<int>& neur, ActivationType type) {
   vector<int> N;
   for (int i=0; i<neur.size(); i++) N.push_back(neur.at(i));
   for (int i=neur.size()-2; i>=0; i--) N.push_back(neur.at(i));
@@ -104,6 +269,8 @@ void Network::createAutoEncoder(vector<int>& neur, function F, function DF) {
 
     layers[i] = S;
   }
+  for (i=1; i<total; i++) layers[i]->setActivation(type);
+  createArenas();
   
   initialized = true;
   checkCorrect = false;
@@ -111,54 +278,73 @@ void Network::createAutoEncoder(vector<int>& neur, function F, function DF) {
 
 void Network::train(int NData) {
   if (!checkStart(NData)) return;
+  createWorkers();
 
   if (minibatch<=0 || minibatch>NData) minibatch = NData;
   int nBatches = NData/minibatch;
   int leftOver = NData % minibatch;
-  int outSize = targets.at(0)->size();
+  int outSize = trainData().targetSize();
   double invErrNorm = 1.0/(NData*outSize);
   clearMatrices(); // Initial clear
-  clock_t beginning = clock();
+  startTraining();
+  // Wall clock time, since clock() adds up the time of all the threads
+  double beginning = MPI_Wtime();
   for (int iter=0; iter<trainingIters; iter++) {
     double aveError = 0;
     trainCorrect = 0;
     // Start Timing
-    clock_t start = clock();
-    factor = rate/minibatch;
-    L2factor = L2const * rate;
-    for (int i=0; i<nBatches; i++) {
-      trainMinibatch(i*minibatch, minibatch, aveError);
-      gradientDescent();
-      clearMatrices();
-    }
-    // Catch anything left out of a minibatch, make it its own minibatch
-    factor = leftOver==0 ? 0 : rate/leftOver;
-    if (leftOver>0) {
-      trainMinibatch(NData-leftOver, leftOver, aveError);
-      gradientDescent();
-      clearMatrices();
+    double start = MPI_Wtime();
+    iterRate = scheduledRate(iter);
+    if (shuffle) shuffleOrder(NData, iter);
+    factor = 1./minibatch;
+    if (mode==HogwildTraining && work.size()>1) trainHogwild(NData, aveError);
+    else {
+      if (prefetch) {
+	vector<pair<int,int>> batches;
+	for (int i=0; i<nBatches; i++) batches.push_back(pair<int,int>(i*minibatch, minibatch));
+	if (leftOver>0) batches.push_back(pair<int,int>(NData-leftOver, leftOver));
+	startPrefetch(batches);
+      }
+      for (int i=0; i<nBatches; i++) {
+	trainMinibatch(i*minibatch, minibatch, aveError);
+	gradientDescent();
+	clearMatrices();
+      }
+      // Catch anything left out of a minibatch, make it its own minibatch
+      factor = leftOver==0 ? 0 : 1./leftOver;
+      if (leftOver>0) {
+	trainMinibatch(NData-leftOver, leftOver, aveError);
+	gradientDescent();
+	clearMatrices();
+      }
+      stopPrefetch();
     }
     // Iteration finished
-    clock_t end = clock();
+    double end = MPI_Wtime();
     if (invErrNorm!=0) aveError*=invErrNorm;
     // Check on test set
-    if (doTest && testInputs.size()>0) {
+    if (doTest && testData().size()>0) {
       checkTestSet();
-      testPercentRec.push_back((double)testCorrect/testInputs.size());
+      testPercentRec.push_back((double)testCorrect/testData().size());
     }
+    prof.endEpoch();
     // Display iteration summary
-    timeRec.push_back((double)(end-start)/CLOCKS_PER_SEC);
+    timeRec.push_back(end-start);
+    rateRec.push_back(iterRate);
+    recordThroughput(NData, end-start);
     
-    if (display) printData(iter+1, (float)(end-start)/CLOCKS_PER_SEC, aveError);
+    if (display) printData(iter+1, end-start, aveError, NData, NData);
     // Record data
     if (calcError) {
       errorRec.push_back(aveError);
-      double time = (double)(end-beginning)/CLOCKS_PER_SEC;
+      double time = end-beginning;
       auto R = pair<double, double>(time, aveError);
       errVtime.push_back(R);
     }
-    if (checkCorrect) trainPercentRec.push_back((double)trainCorrect/inputs.size());
+    if (checkCorrect) trainPercentRec.push_back((double)trainCorrect/trainData().size());
+    if (checkStop(iter, false)) break;
   }
+  finishTraining();
   if (display) cout << "Training over." << endl;
 }
 
@@ -172,12 +358,13 @@ void Network::trainMPI(int NData) {
   
   // Create common tensor structure
   createCommonTensorPool();
+  createWorkers();
   
   if (minibatch<=0 || minibatch>NData) minibatch = NData;
   int nBatches = NData/minibatch;
   int leftOver = NData % minibatch;
   
-  int outSize = targets.at(0)->size();
+  int outSize = trainData().targetSize();
   double invErrNorm = 1.0/(NData*outSize);
 
   // Find out how much of a minibatch to do
@@ -186,72 +373,95 @@ void Network::trainMPI(int NData) {
   num = min(num, minibatch-shift);
   num = max(num, 0);
 
-  clock_t start, end, beginning;
-  if (rank==0) beginning = clock();
+  // Start the allreduces from inside backPropagate, unless the gradients are first summed over threads
+  overlapping = overlapComm && work.size()==1;
+  double start, end, beginning;
+  if (rank==0) beginning = MPI_Wtime();
   clearMatrices(); // Initial clear
+  startTraining();
   for (int iter=0; iter<trainingIters; iter++) {
     double aveError = 0;
     trainCorrect = 0;
+    commTime = 0;
     // Start Timing
-    if (rank==0) start = clock();
-    factor = rate/minibatch;
-    L2factor = L2const * rate;
+    if (rank==0) start = MPI_Wtime();
+    iterRate = scheduledRate(iter);
+    if (shuffle) shuffleOrder(NData, iter);
+    factor = 1./minibatch;
+    if (prefetch && num>0) {
+      vector<pair<int,int>> batches;
+      for (int i=0; i<nBatches; i++) batches.push_back(pair<int,int>(i*minibatch+shift, num));
+      startPrefetch(batches);
+    }
     for (int i=0; i<nBatches; i++) {
       trainMinibatch(i*minibatch+shift, num, aveError);
-      MPI_Barrier( MPI_COMM_WORLD );
-      // Gather and add delta matrices
-      if (size>1)
-	for (auto T : commonTensors)
-	  MPI_Allreduce(MPI_IN_PLACE, T->getArray(), T->size(), MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+      // Gather and add delta matrices. The allreduce itself waits for every process
+      if (overlapping) waitAllreduce();
+      else allreduceGradients();
 
       // Do a gradient descent
       gradientDescent();
       clearMatrices();
     }
+    stopPrefetch();
     // Catch anything left out of a minibatch, make it its own minibatch
     /*
-    factor = rate/leftOver;
+    factor = 1./leftOver;
     if (leftOver>0) {
       trainMinibatch(NData-leftOver, leftOver, aveError);
       
       MPI_Barrier( MPI_COMM_WORLD );
       // Gather and add delta matrices
       for (auto T : commonTensors)
-        MPI_Allreduce(MPI_IN_PLACE, T->getArray(), T->size(), MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);      
+        MPI_Allreduce(MPI_IN_PLACE, T->getArray(), T->size(), MPI_NN_REAL, MPI_SUM, MPI_COMM_WORLD);      
       gradientDescent();
       clearMatrices();
     }
     */
     
     // Get stats from all the processes
-    MPI_Barrier( MPI_COMM_WORLD );
     if (size>1) {
       MPI_Allreduce(MPI_IN_PLACE, &trainCorrect, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
       MPI_Allreduce(MPI_IN_PLACE, &aveError, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
     }
     // Iteration finished
     if (rank==0) {
-      end = clock();
-      timeRec.push_back((double)(end-start)/CLOCKS_PER_SEC);
+      end = MPI_Wtime();
+      timeRec.push_back(end-start);
+      commTimeRec.push_back(commTime);
+      rateRec.push_back(iterRate);
+      recordThroughput(nBatches*minibatch, end-start);
       aveError*=invErrNorm;
       // Check on test set
-      if (doTest && testInputs.size()>0) {
+      if (doTest && testData().size()>0) {
         checkTestSet();
-        testPercentRec.push_back((double)testCorrect/testInputs.size());
+        testPercentRec.push_back((double)testCorrect/testData().size());
       }
+      prof.endEpoch();
       // Display iteration summary
-      if (display) printData(iter+1, (float)(end-start)/CLOCKS_PER_SEC, aveError);
+      if (display) {
+	printData(iter+1, end-start, aveError, nBatches*minibatch, nBatches*num);
+	cout << "Communication: " << commTime << " seconds, " << 1000*commTime/nBatches << " ms per step ";
+	if (overlapping) cout << "waiting for " << total-1 << " allreduce(s) overlapped with backpropagation";
+	else cout << "in " << buckets.size() << " allreduce(s)";
+	cout << " of " << gradSize << " entries" << endl << endl;
+      }
       // Record data
       if (calcError) {
 	errorRec.push_back(aveError);
-	double time = (double)(end-beginning)/CLOCKS_PER_SEC;
+	double time = end-beginning;
 	auto R = pair<double, double>(time, aveError);
 	errVtime.push_back(R);
       }
-      if (checkCorrect) trainPercentRec.push_back((double)trainCorrect/inputs.size());
+      if (checkCorrect) trainPercentRec.push_back((double)trainCorrect/trainData().size());
     }
+    else prof.endEpoch();
+    if (checkStop(iter, true)) break;
     MPI_Barrier( MPI_COMM_WORLD ); // Wait to start the next iteration
   }
+  finishTraining();
+
+  overlapping = false;
 
   // Finalize MPI
   MPI_Barrier( MPI_COMM_WORLD );
@@ -260,90 +470,169 @@ void Network::trainMPI(int NData) {
   if (rank==0 && display) cout << "Training over." << endl;
 }
 
-Tensor Network::feedForward(Tensor& input) {
-  aout[0].qref(input);
-  for (int i=1; i<total; i++)
-    layers[i]->feedForward(aout[i-1], aout[i], zout[i]);
-  aout[0].qrel();
-  return aout[total-1];
+const Tensor& Network::feedForward(const Tensor& input) {
+  Workspace &w = *work[0];
+  setBatchCols(w, 1);
+  const real *in = input.getArray();
+  real *a = w.aout[0].getArray();
+  for (int i=0; i<neurons.at(0); i++) a[i] = in[i];
+  feedForward(w);
+  return w.aout[total-1];
 }
 
-inline void Network::feedForward() {
-  for (int i=1; i<total; i++)
-    layers[i]->feedForward(aout[i-1], aout[i], zout[i]);
+void Network::feedForward(const Tensor& input, Tensor& output) {
+  output = feedForward(input); // Reuses output's array if it is large enough
 }
 
-double Network::getAveTime() {
-  if (rank==0) {
-    if (timeRec.size()==0) return -1;
-    double ave;  
-    for (auto t : timeRec) ave += t;
-    return ave/timeRec.size();
+/// Resize T to rows x cols, unless it already is. Resizing zeroes, so this also
+/// leaves a batch the loader staged alone
+inline void fitBatch(Tensor& T, int rows, int cols) {
+  if (T.size()!=rows*cols) T.resize(rows, cols);
+}
+
+/// Resize the activation, preactivation and delta arrays so that
+/// they hold [cols] samples, one per column. Each array is checked on its
+/// own, since taking a batch from the loader swaps aout[0] and targetBatch
+inline void Network::setBatchCols(Workspace& w, int cols) {
+  fitBatch(w.aout[0], neurons.at(0), cols);
+  fitBatch(w.zout[0], neurons.at(0), cols);
+  for (int i=1; i<total; i++) {
+    fitBatch(w.aout[i], neurons.at(i), cols);
+    fitBatch(w.zout[i], neurons.at(i), cols);
+    fitBatch(w.deltas[i], neurons.at(i), cols);
   }
+  fitBatch(w.targetBatch, neurons.at(total-1), cols);
 }
 
-/// Checks if the maximum entry of target corresponds to the
-/// maximum entry of the result ( aout[total-1] )
-inline bool Network::checkMax(const Tensor& target) {
-  // Assumes output, target are vectors
-  if (aout[total-1].getRows()!=target.getRows())
-    throw 1; // Make a real error for this sometime
+/// Copy samples [base, base+num) into the columns of aout[0] and targetBatch. With
+/// an index, the samples are index[base], ..., index[base+num-1] instead. Profiled
+/// as [phase] (training data or evaluation)
+inline void Network::stageBatch(Workspace& w, const Dataset& data, int base, int num, const int *index, ProfilePhase phase) {
+  double begin = prof.start();
+  setBatchCols(w, num);
+  if (index) data.stage(index+base, num, w.aout[0].getArray(), w.targetBatch.getArray());
+  else data.stage(base, num, w.aout[0].getArray(), w.targetBatch.getArray());
+  prof.stop(phase, 0, begin, w.thread);
+}
 
+/// The forward pass, profiled as [phase] (training or evaluation)
+inline void Network::feedForward(Workspace& w, ProfilePhase phase) {
+  for (int i=1; i<total; i++) {
+    double begin = prof.start();
+    w.layers[i]->feedForward(w.aout[i-1], w.aout[i], w.zout[i]);
+    prof.stop(phase, i, begin, w.thread);
+  }
+}
+
+/// Only the processes that record the times (all of them in train, the root in trainMPI) have an average
+double Network::getAveTime() {
+  if (timeRec.empty()) return -1;
+  double ave = 0;
+  for (auto t : timeRec) ave += t;
+  return ave/timeRec.size();
+}
+
+/// Checks if the maximum entry of the target in column [col] corresponds to
+/// the maximum entry of the result ( aout[total-1] ) in that column
+inline bool Network::checkMax(Workspace& w, int col) {
+  const Tensor &output = w.aout[total-1], &targetBatch = w.targetBatch;
   int t_index = 0; double t_max = -1e6;
   int o_index = 0; double o_max = -1e6;
-  for (int i=0; i<target.getRows(); i++) {
-    if (target.at(i,0)>t_max) {
-      t_max = target.at(i,0);
+  for (int i=0; i<targetBatch.getRows(); i++) {
+    if (targetBatch.at(i,col)>t_max) {
+      t_max = targetBatch.at(i,col);
       t_index = i;
     }
-    if (aout[total-1].at(i,0)>o_max) {
-      o_max = aout[total-1].at(i,0);
+    if (output.at(i,col)>o_max) {
+      o_max = output.at(i,col);
       o_index =i;
     }
   }
   return t_index==o_index;
 }
 
-/// Squared error
-inline double Network::sqrError(const Tensor& target) {
+/// Squared error of column [col]
+inline double Network::sqrError(Workspace& w, int col) {
   double error = 0;
-  for (int i=0; i<target.getRows(); i++)
-    error += sqr(target.at(i,0) - aout[total-1].at(i,0));
+  for (int i=0; i<w.targetBatch.getRows(); i++)
+    error += sqr(w.targetBatch.at(i,col) - w.aout[total-1].at(i,col));
   return error;
 }
 
 /// This error is the cross entropy
-inline void Network::outputError(const Tensor& target) {
-  subtract(aout[total-1], target, deltas[total-1]);
+inline void Network::outputError(Workspace& w) {
+  double begin = prof.start();
+  subtract(w.aout[total-1], w.targetBatch, w.deltas[total-1]);
+  prof.stop(BackwardPhase, total-1, begin, w.thread);
 }
 
-inline void Network::backPropagate() {
-  for (int j=total-1; j>1; j--)
-    layers[j]->backPropagate(deltas[j], deltas[j-1], zout[j-1]);
-  // Update weight and bias deltas
-  for (int j=1; j<total; j++)
-    layers[j]->updateDeltas(aout[j-1], deltas[j]);
+/// Time profiled as layer j's backward phase is the work of finding layer j-1's deltas
+inline void Network::backPropagate(Workspace& w) {
+  for (int j=total-1; j>0; j--) {
+    // Layer j's deltas are final, so its weight and bias deltas are too
+    double begin = prof.start();
+    w.layers[j]->updateDeltas(w.aout[j-1], w.deltas[j]);
+    prof.stop(GradientPhase, j, begin, w.thread);
+    if (overlapping) startAllreduce(j);
+    if (j>1) {
+      begin = prof.start();
+      w.layers[j]->backPropagate(w.deltas[j], w.deltas[j-1]);
+      w.layers[j-1]->backActivation(w.aout[j-1], w.deltas[j-1]);
+      prof.stop(BackwardPhase, j, begin, w.thread);
+    }
+  }
 }
 
+/// Add the gradient of each tied weight tensor's second place into its first
+inline void Network::foldGradients(real *grads) {
+  for (auto& F : folds) {
+    const real *from = grads+F.from;
+    real *to = grads+F.to;
+    if (F.transposed) {
+      for (int r=0; r<F.rows; r++)
+	for (int c=0; c<F.cols; c++) to[c*F.rows+r] += from[r*F.cols+c];
+    }
+    else for (int j=0; j<F.rows*F.cols; j++) to[j] += from[j];
+  }
+}
+
+/// Update the parameters of the layers being trained from the summed gradients
 inline void Network::gradientDescent() {
-  for (int i=1; i<total; i++) 
-    if (trainMarker[i]) 
-      layers[i]->gradientDescent(factor);
+  real *grads = work[0]->grads;
+  double begin = prof.start();
+  foldGradients(grads);
+  optimizer->nextStep();
+  prof.stop(OptimizerPhase, 0, begin);
+  for (auto& S : segments)
+    if (trainMarker[S.layer]) {
+      begin = prof.start();
+      optimizer->update(params+S.offset, grads+S.offset, S.size, S.offset, iterRate, factor, S.weights ? L2const : 0);
+      prof.stop(OptimizerPhase, S.layer, begin);
+    }
+}
+
+void Network::setOptimizer(Optimizer *opt) {
+  if (!opt || opt==optimizer) return;
+  delete optimizer;
+  optimizer = opt;
+  if (initialized) optimizer->setSize(paramSize);
 }
 
 inline void Network::clearMatrices() {
-  for (int i=1; i<total; i++) {
-    layers[i]->clear();
-    deltas[i].zero();
+  double begin = prof.start();
+  for (auto w : work) {
+    memset(w->grads, 0, gradSize*sizeof(real));
+    for (int i=1; i<total; i++) w->deltas[i].zero();
   }
+  prof.stop(GradientPhase, 0, begin);
 }
 
 inline bool Network::checkStart(int& NData, bool quiet) {
-  if (inputs.size()!=targets.size()) {
+  if (!trainSet && inputs.size()!=targets.size()) {
     if (!quiet) cout << "Training Input size (" << inputs.size() << "and Target size (" << targets.size() << ") do not match." << endl;
     return false; // Mismatch
   }
-  if (testInputs.size()!=testTargets.size() && doTest) {
+  if (!testSet && testInputs.size()!=testTargets.size() && doTest) {
     if (!quiet) cout << "Test Input size (" << testInputs.size() << ") and Target size (" << testTargets.size() << ") do not match." << endl;
     return false; // Mismatch
   }
@@ -351,7 +640,12 @@ inline bool Network::checkStart(int& NData, bool quiet) {
     if (!quiet) cout << "Network uninitialized" << endl;
     return false; // Uninitialized
   }
-  if (NData<0 || NData>inputs.size()) NData = inputs.size();
+  const Dataset &data = trainData();
+  if (data.size()>0 && (data.inputSize()!=neurons.at(0) || data.targetSize()!=neurons.at(total-1))) {
+    if (!quiet) cout << "Samples of size " << data.inputSize() << " -> " << data.targetSize() << " do not fit the network." << endl;
+    return false; // Mismatch
+  }
+  if (NData<0 || NData>data.size()) NData = data.size();
   if (NData==0) {
     if (!quiet) cout << "No data to train on" << endl;
     return false; // No data
@@ -363,35 +657,277 @@ inline bool Network::checkStart(int& NData, bool quiet) {
     int complexity = 0, biases = 0;
     for (int i=1; i<neurons.size(); i++) complexity += neurons.at(i)*neurons.at(i-1);
     for (int i=1; i<neurons.size(); i++) biases += neurons.at(i);
-    cout << "Net complexity: Weights: " << complexity << ", Biases: " << biases << endl << endl;
+    cout << "Net complexity: Weights: " << complexity << ", Biases: " << biases << endl;
+    double flops = 0, bytes = 0;
+    int cols = max(minibatch/nThreads, 1);
+    for (int i=1; i<neurons.size(); i++) {
+      flops += layerFlops(i);
+      bytes += layerBytes(i, cols);
+    }
+    cout << "Training FLOPs per sample: " << flops << ", arithmetic intensity about " << flops*cols/bytes << " FLOP/byte" << endl << endl;
   }
   return true;
 }
 
+/// Put the first NData training samples in a new order for iteration iter. The
+/// order only depends on the seed and the iteration, so every process makes the
+/// same one and the processes still split each minibatch between them. The samples
+/// of each minibatch are then sorted, which does not change what the minibatch
+/// holds, but lets staging read forward through memory
+inline void Network::shuffleOrder(int NData, int iter) {
+  order.resize(NData);
+  std::iota(order.begin(), order.end(), 0);
+  // mt19937_64 and seed_seq are fully specified, unlike std::shuffle, so this is the same everywhere
+  std::seed_seq seeds{shuffleSeed, static_cast<unsigned>(iter)};
+  std::mt19937_64 generator(seeds);
+  for (int i=NData-1; i>0; i--) std::swap(order[i], order[generator()%(i+1)]);
+  for (int b=0; b<NData; b+=minibatch)
+    std::sort(order.begin()+b, order.begin()+min(b+minibatch, NData));
+}
+
+/// Have the loader stage these batches of the training set, one per minibatch,
+/// each split between the threads
+inline void Network::startPrefetch(vector<pair<int,int>>& batches) {
+  loader.start(trainData(), batches, work.size(), shuffle ? order.data() : 0);
+  prefetching = true;
+}
+
+inline void Network::stopPrefetch() {
+  loader.stop();
+  prefetching = false;
+}
+
+/// Wait for the loader's next batch and swap each thread's part of it into that
+/// thread's workspace. The loader gets the old arrays back to stage the batch after
+inline void Network::takeBatch() {
+  double begin = prof.start();
+  loader.next();
+  for (auto w : work) {
+    std::swap(w->aout[0], loader.input(w->thread));
+    std::swap(w->targetBatch, loader.target(w->thread));
+  }
+  loader.release();
+  prof.stop(DataPhase, 0, begin);
+}
+
+/// Train on samples [base, base+num), split evenly between the threads. The
+/// gradients end up summed in the network's own layers
 inline void Network::trainMinibatch(int base, int num, double& aveError) {
+  if (num<=0) {
+    // With more processes than samples some get none, but they must still join
+    // every layer's allreduce, in the same order as backPropagate starts them.
+    // Their gradients were cleared after the last step, so they add nothing
+    if (overlapping)
+      for (int j=total-1; j>0; j--) startAllreduce(j);
+    return;
+  }
+  if (prefetching) takeBatch();
+  int T = work.size();
+  pool->run([&] (int t) {
+    int first = num*t/T, last = num*(t+1)/T;
+    trainPart(*work[t], base+first, last-first);
+  });
+  for (auto w : work) {
+    trainCorrect += w->correct;
+    aveError += w->error;
+  }
+  if (T>1) {
+    // Summing the threads' gradients counts as communication
+    double begin = prof.start();
+    reduceGradients();
+    prof.stop(CommPhase, 0, begin);
+  }
+}
+
+/// Train on samples [base, base+num) as a single batch. Every layer does one
+/// matrix-matrix product forward, one backward and one for the weight gradient
+inline void Network::trainPart(Workspace& w, int base, int num) {
+  w.correct = 0;
+  w.error = 0;
+  if (num<=0) return;
+  // The loader has already put the batch in place, so just size the other arrays for it
+  if (prefetching) setBatchCols(w, num);
+  else stageBatch(w, trainData(), base, num, shuffle ? order.data() : 0);
+  feedForward(w);
   for (int j=0; j<num; j++) {
-    int index = base+j;
-    aout[0].qref(*inputs.at(index)); // Reference input
-    feedForward();
     // Check if was correct
-    if (checkCorrect && checkMax(*targets.at(index))) trainCorrect++;
+    if (checkCorrect && checkMax(w, j)) w.correct++;
     // Calculate the error
-    if (calcError) aveError += sqrError(*targets.at(index));
-    // Backpropagate
-    outputError(*targets.at(index));
-    backPropagate();
-    aout[0].qrel(); // Release reference
+    if (calcError) w.error += sqrError(w, j);
+  }
+  // Backpropagate
+  outputError(w);
+  backPropagate(w);
+}
+
+/// Hogwild training: each thread trains on its own shard of the data and applies
+/// its updates to the shared weights and biases as soon as it has them, without
+/// any locks or waiting for the other threads. The updates race with the other
+/// threads, which costs little when each update only changes a small part of the
+/// weights (as with sparse inputs). The updates are always plain SGD, since the
+/// other optimizers' state would race as well
+inline void Network::trainHogwild(int NData, double& aveError) {
+  int T = work.size();
+  SGD sgd;
+  pool->run([&] (int t) {
+    Workspace &w = *work[t];
+    int first = NData*t/T, last = NData*(t+1)/T, correct = 0;
+    double error = 0;
+    for (int base=first; base<last; base+=minibatch) {
+      int num = min(minibatch, last-base);
+      trainPart(w, base, num);
+      correct += w.correct;
+      error += w.error;
+      double begin = prof.start();
+      foldGradients(w.grads);
+      for (auto& S : segments)
+	if (trainMarker[S.layer])
+	  sgd.update(params+S.offset, w.grads+S.offset, S.size, S.offset, iterRate, 1./num, S.weights ? L2const : 0);
+      memset(w.grads, 0, gradSize*sizeof(real));
+      prof.stop(OptimizerPhase, 0, begin, t);
+    }
+    w.correct = correct;
+    w.error = error;
+  });
+  for (auto w : work) {
+    trainCorrect += w->correct;
+    aveError += w->error;
+  }
+}
+
+/// Add the gradient arenas of the other workspaces to the network's own. Each
+/// thread sums its own stripe of whole cache lines
+inline void Network::reduceGradients() {
+  int T = work.size(), lines = gradSize/alignEntries(1);
+  pool->run([&] (int t) {
+    int first = lines*t/T*alignEntries(1), last = lines*(t+1)/T*alignEntries(1);
+    real *sum = work[0]->grads;
+    for (int p=1; p<T; p++) {
+      const real *part = work[p]->grads;
+      for (int i=first; i<last; i++) sum[i] += part[i];
+    }
+  });
+}
+
+/// The learning rate for an iteration (from 0). The warmup ramps it up linearly to
+/// the set rate, then the schedule runs over the remaining iterations
+inline double Network::scheduledRate(int iter) {
+  if (iter<warmupIters) return rate*(iter+1)/warmupIters;
+  int t = iter-warmupIters, T = trainingIters-warmupIters;
+  switch (schedule) {
+  case StepRate:
+    return rate*pow(rateDecay, t/max(rateStep, 1));
+  case CosineRate:
+    // The last iteration, t = T-1, is the one at zero
+    return 0.5*rate*(1+cos(M_PI*t/max(T-1, 1)));
+  default:
+    return rate;
+  }
+}
+
+inline void Network::startTraining() {
+  bestIter = 0;
+  bestTest = 0;
+  prof.reset(total, work.size());
+  prof.setEnabled(profiling);
+  prof.setTracing(!traceFile.empty());
+}
+
+/// Track the best test set score, copying the parameters that reached it if we
+/// keep the best ones. Returns whether to stop early. If shared, all the processes
+/// of trainMPI take the decision of the root process, which is the one that checks
+/// the test set
+inline bool Network::checkStop(int iter, bool shared) {
+  if (patience<=0 && !keepBest) return false;
+  int status[3] = {0, 0, bestIter}; // Whether the score improved, whether to stop, the best iteration
+  if ((rank==0 || !shared) && doTest && testData().size()>0) {
+    double score = testPercentRec.back();
+    if (bestIter==0 || score>bestTest) {
+      bestTest = score;
+      status[0] = 1;
+      status[2] = iter+1;
+    }
+    status[1] = patience>0 && iter+1-status[2]>=patience;
+  }
+  if (shared) MPI_Bcast(status, 3, MPI_INT, 0, MPI_COMM_WORLD);
+  bestIter = status[2];
+  if (status[0] && keepBest) {
+    if (!bestParams) bestParams = newArena(paramSize);
+    memcpy(bestParams, params, paramSize*sizeof(real));
+  }
+  if (status[1] && display && rank==0)
+    cout << "No better test score for " << patience << " iterations, stopping." << endl;
+  return status[1];
+}
+
+/// Restore the parameters with the best test score, if we keep them, and report
+/// the profile. In trainMPI each process writes its own trace, tagged with its rank
+inline void Network::finishTraining() {
+  if (keepBest && bestIter>0) {
+    memcpy(params, bestParams, paramSize*sizeof(real));
+    if (display && rank==0) cout << "Keeping the parameters from iteration " << bestIter << " (test score " << bestTest << ")." << endl;
+  }
+  if (!prof.enabled()) return;
+  prof.setEnabled(false);
+  if (display && rank==0) prof.print(cout);
+  if (!traceFile.empty()) {
+    string name = traceFile;
+    if (size>1) name += "." + std::to_string(rank);
+    if (!prof.writeTrace(name, rank)) cout << "Could not write the trace to " << name << endl;
   }
 }
 
-inline void Network::printData(int iter, float time, double aveError) {
+/// Floating point operations to train layer [i] on one sample: the forward
+/// product, the weight gradient and (above the first layer) the deltas of the
+/// layer below take 2*inputs*outputs each, the bias, activation and derivative a
+/// few per output
+inline double Network::layerFlops(int i) {
+  double n = neurons.at(i-1), m = neurons.at(i);
+  return (i>1 ? 3 : 2)*2*n*m + 4*m;
+}
+
+/// Estimated bytes layer [i] moves to train on a batch of [cols] samples, if every
+/// pass streams its arrays through memory once. The forward pass reads the weights
+/// and inputs and writes the outputs, the weight gradient reads the inputs and
+/// deltas and updates the gradient, the backward pass reads the weights and deltas,
+/// writes the deltas below and applies the activation derivative to them, and the
+/// optimizer reads the gradient and updates the parameters
+inline double Network::layerBytes(int i, int cols) {
+  double n = neurons.at(i-1), m = neurons.at(i), W = n*m+m;
+  double entries = W + (n+m)*cols + 2*W + (n+m)*cols + 3*W;
+  if (i>1) entries += W + (m+3*n)*cols;
+  return entries*sizeof(real);
+}
+
+/// Record the samples per second and GFLOP/s of an iteration that trained on [samples] samples
+inline void Network::recordThroughput(int samples, double time) {
+  double flops = 0;
+  for (int i=1; i<total; i++) flops += layerFlops(i);
+  samplesRec.push_back(time>0 ? samples/time : 0);
+  gflopsRec.push_back(time>0 ? 1e-9*flops*samples/time : 0);
+}
+
+/// Print the summary of an iteration. [samples] were trained on in all, [local] of
+/// them by this process
+inline void Network::printData(int iter, float time, double aveError, int samples, int local) {
   cout << "Iteration " << iter << ": " << time << " seconds." << endl;
+  cout << "Throughput: " << samplesRec.back() << " samples/s, " << gflopsRec.back() << " GFLOP/s" << endl;
+  // With the profile, the rate of each layer on its own (forward, backward and gradient time, summed over threads)
+  if (prof.enabled() && prof.epochs()>0) {
+    int e = prof.epochs()-1, cols = max(minibatch/(int)work.size(), 1);
+    for (int i=1; i<total; i++) {
+      double t = prof.time(e, ForwardPhase, i)+prof.time(e, BackwardPhase, i)+prof.time(e, GradientPhase, i);
+      cout << "  Layer " << i << ": " << (t>0 ? 1e-9*layerFlops(i)*local/t : 0) << " GFLOP/s per thread, "
+	   << layerFlops(i)*cols/layerBytes(i, cols) << " FLOP/byte" << endl;
+    }
+  }
+  if (schedule!=ConstantRate || warmupIters>0) cout << "Rate: " << iterRate << endl;
   if (calcError) cout << "Ave Error: " << aveError << endl;
   if (checkCorrect)
-    cout << "Training Set: " << trainCorrect << "/" << inputs.size() << " (" << 100.*\
-      static_cast<double>(trainCorrect)/inputs.size() << "%)" << endl;
+    cout << "Training Set: " << trainCorrect << "/" << trainData().size() << " (" << 100.*\
+      static_cast<double>(trainCorrect)/trainData().size() << "%)" << endl;
   // See how we do on the test set
-  if (doTest && !testInputs.empty()) {
+  if (doTest && testData().size()>0) {
     /*
     int correct = 0;
     for (int i=0; i<testInputs.size(); i++) {
@@ -401,17 +937,25 @@ inline void Network::printData(int iter, float time, double aveError) {
       aout[0].qrel();
     }
     */
-    cout << "Test Set: " << testCorrect << "/" << testInputs.size() << " (" << 100.*static_cast<double>(testCorrect)/testInputs.size() << "%)\n";
+    cout << "Test Set: " << testCorrect << "/" << testData().size() << " (" << 100.*static_cast<double>(testCorrect)/testData().size() << "%)\n";
   }
   cout << endl;
 }
 
 inline void Network::checkTestSet() {
   testCorrect = 0;
-  for (int i=0; i<testInputs.size(); i++) {
-    aout[0].qref(*testInputs.at(i));
-    feedForward();
-    if (checkMax(*testTargets.at(i))) testCorrect++;
-    aout[0].qrel();
-  }
+  int NTest = testData().size(), T = work.size();
+  // Thread t does every T-th chunk
+  pool->run([&] (int t) {
+    Workspace &w = *work[t];
+    w.correct = 0;
+    for (int base=t*minibatch; base<NTest; base+=T*minibatch) {
+      int num = min(minibatch, NTest-base);
+      stageBatch(w, testData(), base, num, 0, EvalPhase);
+      feedForward(w, EvalPhase);
+      for (int j=0; j<num; j++)
+	if (checkMax(w, j)) w.correct++;
+    }
+  });
+  for (auto w : work) testCorrect += w->correct;
 }
@@ -8,8 +8,20 @@
 #include <mpi.h>
 
 #include "Neuron.h"
+#include "ThreadPool.h"
+#include "Optimizer.h"
+#include "Profiler.h"
+#include "Dataset.h"
+#include "DataLoader.h"
 #include "EasyBMP/EasyBMP.h"
 
+// The MPI type of a tensor entry
+#ifdef NN_FLOAT
+#define MPI_NN_REAL MPI_FLOAT
+#else
+#define MPI_NN_REAL MPI_DOUBLE
+#endif
+
 inline void createImage(Tensor& M, BMP& image) {
   int width = M.getCols(), height = M.getRows();
   image.SetSize(width, height);
@@ -33,6 +45,17 @@ inline void writeImage(Tensor& M, string fileName, int mark=-1) {
   image.WriteToFile(fileName.c_str());
 }
 
+/// How train() uses several threads. Synchronous training sums the gradients
+/// of all threads for every minibatch, Hogwild lets the threads update the
+/// weights on their own, without locks. Between MPI processes, training is always synchronous
+enum TrainingMode { SyncTraining, HogwildTraining };
+
+/// How the learning rate changes over the training iterations. A constant rate,
+/// one multiplied by a decay factor every few iterations, or one that follows half
+/// a cosine from the set rate down to zero at the last iteration. Any warmup
+/// comes before the schedule
+enum RateSchedule { ConstantRate, StepRate, CosineRate };
+
 /// The Network class
 class Network {
  public:
@@ -40,25 +63,45 @@ class Network {
   ~Network();
 
   // Network initialization
-  void createFeedForward(vector<int>& neurons, function F, function DF);  
-  void createAutoEncoder(vector<int>& neurons, function F, function DF);
+  // Every layer starts with the given activation, setActivation can change it later
+  void createFeedForward(vector<int>& neurons, ActivationType type=ActSigmoid);
+  void createAutoEncoder(vector<int>& neurons, ActivationType type=ActSigmoid);
 
   // Network training/use
   void train(int subset=-1);
   void trainMPI(int subset=-1);
-  Tensor feedForward(Tensor& input);
+  const Tensor& feedForward(const Tensor& input); // Valid until the next call
+  void feedForward(const Tensor& input, Tensor& output);
 
   // Accessors
   vector<double> getErrorRec() { return errorRec; }
   vector<double> getTestPercentRec() { return testPercentRec; }
   vector<double> getTrainPercentRec() { return trainPercentRec; }
   vector<double> getTimeRec() { return timeRec; }
+  vector<double> getCommTimeRec() { return commTimeRec; } // Seconds in gradient allreduces per iteration (trainMPI), including waiting for slower processes
+  vector<double> getRateRec() { return rateRec; }
+  vector<double> getSamplesPerSecRec() { return samplesRec; } // Training samples per second of each iteration, over all processes
+  vector<double> getGflopsRec() { return gflopsRec; }         // GFLOP/s of each iteration, from the FLOP counts of the layer shapes
+  int getBestIter() { return bestIter; } // The iteration with the best test set score (from 1), 0 if there was none
+  const Profiler& getProfiler() { return prof; } // Time per phase and layer of each iteration of the last training run
   auto getErrVTime() { return errVtime; }
   double getAveTime();
   void printDescription();
 
   // Mutators
+  void setActivation(ActivationType type, int layer=-1); // Layer 1 is the first hidden layer, -1 for all layers
+  void setCacheDerivatives(bool c); // Keep f'(z) from the forward pass rather than deriving it from the outputs
+  void setThreads(int n) { nThreads = n<1 ? 1 : n; } // Threads per process that share each minibatch
+  void setTrainingMode(TrainingMode m) { mode = m; }
+  void setBucketSize(int s) { bucketSize = s; } // Entries per gradient allreduce in trainMPI, 0 for one per tensor
+  void setOverlapComm(bool o) { overlapComm = o; } // Reduce each layer's gradients during backpropagation (one thread per process only)
+  void setOptimizer(Optimizer *opt); // The network takes ownership
+  void setProfiling(bool p, string trace="") { profiling = p; traceFile = trace; } // Also write a Chrome trace, if given a file name
   void setRate(double r) { rate = r; }
+  void setRateSchedule(RateSchedule s, int step=10, double decay=0.1) { schedule = s; rateStep = step; rateDecay = decay; } // Step and decay are for StepRate
+  void setWarmup(int iters) { warmupIters = iters; } // Ramp the rate up linearly over the first iters iterations
+  void setEarlyStopping(int p) { patience = p; } // Stop after p iterations without a better test score, 0 never stops
+  void setKeepBest(bool k) { keepBest = k; } // Finish training with the parameters that had the best test score
   void setL2const(double l2) { L2const = l2; }
   void setTrainingIters(int i) { trainingIters = i; }
   void setMinibatch(int m) { minibatch = m; }
@@ -69,20 +112,34 @@ class Network {
   void setTargets(vector<Tensor*>& targets) { this->targets = targets; }
   void setTestInputs(vector<Tensor*>& inputs) { testInputs = inputs; }
   void setTestTargets(vector<Tensor*>& targets) { testTargets = targets; }
+  void setTrainingSet(const Dataset& d) { trainSet = &d; } // Used instead of the inputs and targets, it must outlive training
+  void setTestSet(const Dataset& d) { testSet = &d; }
+  void setPrefetch(bool p) { prefetch = p; } // Stage the next minibatch on a background thread while training on this one (not for Hogwild)
+  void setShuffle(bool s, unsigned seed=1) { shuffle = s; shuffleSeed = seed; } // Train on the samples in a new order every iteration, the same on every process
 
  private:
   // Network data
-  function fnct, dfnct; // Neuron function and its derivative
   vector<int> neurons;
   int total;         // Total number of [a] arrays needed (number of layers including input)
   bool initialized;  // Whether a network has been initialized or not
   double rate;       // The learning rate
-  double factor;     // rate / minibatch
-  double L2const;    // The L2 penalty
-  double L2factor;   // L2const * rate
+  double iterRate;   // The scheduled learning rate for the current iteration
+  RateSchedule schedule;
+  int rateStep;      // For StepRate, the rate is multiplied by rateDecay every rateStep iterations
+  double rateDecay;
+  int warmupIters;
+  double factor;     // 1 / minibatch, the scale of the summed gradients
+  double L2const;    // The weight decay, applied apart from the optimizer's step
   int trainingIters; // The number of iterations we want to train for
   int minibatch;     // The minibatch size
 
+  // Early stopping
+  int patience;      // Iterations without a better test score before stopping, 0 for no early stopping
+  bool keepBest;     // Whether to end with the parameters that had the best test score
+  int bestIter;      // The iteration with the best test score so far
+  double bestTest;
+  real *bestParams;  // A copy of the parameter arena from that iteration
+
   bool display; // Whether to display iteration data
   bool calcError; // Whether to calculate the squared error or not
   bool checkCorrect; // Whether to check whether training data was correct
@@ -92,6 +149,10 @@ class Network {
   vector<double> testPercentRec;
   vector<double> trainPercentRec;
   vector<double> timeRec;
+  vector<double> commTimeRec;
+  vector<double> rateRec;
+  vector<double> samplesRec;
+  vector<double> gflopsRec;
   vector<pair<double, double>> errVtime;
 
   // Training/Testing data
@@ -100,30 +161,119 @@ class Network {
   bool doTest;
   vector<Tensor*> testInputs;
   vector<Tensor*> testTargets;
+  TensorDataset tensorTrain, tensorTest; // The tensors above, as datasets
+  const Dataset *trainSet, *testSet;     // If set, used instead
+  const Dataset& trainData() { return trainSet ? *trainSet : tensorTrain; }
+  const Dataset& testData() { return testSet ? *testSet : tensorTest; }
+  DataLoader loader;
+  bool prefetch;    // Whether to use the loader
+  bool prefetching; // Whether the loader is staging the batches of this epoch
+  bool shuffle;
+  unsigned shuffleSeed;
+  vector<int> order; // The order of the training samples in this epoch, if shuffling
 
-  // Neuron data
-  Tensor *aout, *zout, *deltas;
+  // Neuron data for one thread's share of a batch - each column of aout/zout/deltas holds one sample
+  struct Workspace {
+    Workspace(int total, Neuron** layers, int thread=0) : total(total), layers(layers), thread(thread), grads(0), correct(0), error(0) {
+      aout = new Tensor[total];
+      zout = new Tensor[total];
+      deltas = new Tensor[total];
+    }
+    ~Workspace() {
+      delete [] aout;
+      delete [] zout;
+      delete [] deltas;
+      if (grads) free(grads);
+    }
+    int total;
+    Neuron** layers;    // The network's own layers for the first workspace, replicas for the others
+    int thread;         // The thread that uses it
+    Tensor *aout, *zout, *deltas;
+    Tensor targetBatch; // Targets for the samples in the current batch, one per column
+    real *grads;        // Arena holding the weight and bias gradients of all the layers
+    int correct;        // Correct guesses and squared error for the last batch
+    double error;
+  };
+  vector<Workspace*> work; // One per thread, work[0] is used outside of training
   Neuron** layers;
+  real *params;             // Arena holding the weights and biases of all the layers
+  int paramSize, gradSize;  // Entries in the parameter and gradient arenas
+  vector<int> gradOffset;   // Where each layer's parameters and gradients start in the arenas
+
+  // Optimization. Each parameter tensor is a segment of the arenas, and each tied
+  // weight tensor's second gradient is folded into the first one before an update
+  Optimizer *optimizer;
+  struct Segment {
+    int layer, offset, size;
+    bool weights; // Whether the weight decay applies
+  };
+  vector<Segment> segments;
+  struct Fold {
+    int from, to;   // Offsets in the gradient arena
+    int rows, cols; // Shape of the gradient being folded
+    bool transposed;
+  };
+  vector<Fold> folds;
   bool *trainMarker; // Which layers to train
 
+  // Profiling
+  Profiler prof;
+  bool profiling;
+  string traceFile;
+
+  // For threads
+  int nThreads;
+  ThreadPool *pool;
+  TrainingMode mode;
+
   // For MPI
   vector<Tensor*> commonTensors; // An array of pointers to delta tensors (for weights and biases)
+  int bucketSize;                // Gradients are summed in buckets of at least this many entries
+  vector<pair<int,int>> buckets; // The range of the gradient arena in each bucket
+  double commTime;               // Time spent in allreduceGradients (or waitAllreduce) this iteration
+  vector<MPI_Request> requests;  // Allreduces started during backpropagation
+  bool overlapComm;              // Whether trainMPI should overlap the allreduces with backpropagation
+  bool overlapping;              // Whether it is doing so right now
   int rank, size;
 
   // Helper functions
   inline void deleteArrays();
   inline void createArrays(vector<int>& neurons);
+  inline void createArenas();
+  inline void layoutGradients(Workspace& w);
   inline void createCommonTensorPool();
-  inline void feedForward();
-  inline bool checkMax(const Tensor& target);
-  inline double sqrError(const Tensor& target);
-  inline void outputError(const Tensor& target);
-  inline void backPropagate();
+  inline void allreduceGradients();
+  inline void startAllreduce(int j);
+  inline void waitAllreduce();
+  inline void createWorkers();
+  inline void deleteWorkers();
+  inline void setBatchCols(Workspace& w, int cols);
+  inline void stageBatch(Workspace& w, const Dataset& data, int base, int num, const int *index=0, ProfilePhase phase=DataPhase);
+  inline void feedForward(Workspace& w, ProfilePhase phase=ForwardPhase);
+  inline bool checkMax(Workspace& w, int col);
+  inline double sqrError(Workspace& w, int col);
+  inline void outputError(Workspace& w);
+  inline void backPropagate(Workspace& w);
+  inline void foldGradients(real *grads);
   inline void gradientDescent();
   inline void clearMatrices();
   inline bool checkStart(int& NData, bool quiet=false);
+  inline void shuffleOrder(int NData, int iter);
+  inline void startPrefetch(vector<pair<int,int>>& batches);
+  inline void stopPrefetch();
+  inline void takeBatch();
   inline void trainMinibatch(int base, int num, double& aveError);
-  inline void printData(int iter, float time, double aveError);
+  inline void trainPart(Workspace& w, int base, int num);
+  inline void reduceGradients();
+  inline void trainHogwild(int NData, double& aveError);
+  inline double scheduledRate(int iter);
+  inline void startTraining();
+  inline bool checkStop(int iter, bool shared);
+  inline void finishTraining();
+  inline double layerFlops(int i);
+  inline double layerBytes(int i, int cols);
+  inline void recordThroughput(int samples, double time);
+  inline void printData(int iter, float time, double aveError, int samples, int local);
   inline void checkTestSet();
 };
 
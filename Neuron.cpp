@@ -5,9 +5,9 @@
 using std::cout;
 using std::endl;
 
-Neuron::Neuron(const Shape& inShape, const Shape& outShape) : inShape(inShape), outShape(outShape) {};
+Neuron::Neuron(const Shape& inShape, const Shape& outShape) : inShape(inShape), outShape(outShape), activation(ActSigmoid), cacheDerivative(false) {};
 
-Sigmoid::Sigmoid(const Shape& inShape, const Shape& outShape, bool tr) : Neuron(inShape, outShape), L2factor(0) {
+Sigmoid::Sigmoid(const Shape& inShape, const Shape& outShape, bool tr) : Neuron(inShape, outShape) {
   // Assume the input/output is a vector (n, 1)
   int in = inShape.at(0), out = outShape.at(0);
   weights = new Tensor(out, in);
@@ -16,66 +16,52 @@ Sigmoid::Sigmoid(const Shape& inShape, const Shape& outShape, bool tr) : Neuron(
   biases = new Tensor(out, 1);
   biases->random();
   bDeltas = new Tensor(out, 1);
-  diff = new Tensor(out, in);
-
-  // Accumulator matrix
-  int d = transposed ? weights->getRows() : weights->getCols(); // getRows()
-  acc.resize(inShape); //d, inShape.at(0)); //deltaIn.getCols());
-  //
-
-  fnct = sigmoid;
-  dfnct = dsigmoid;
 
   owned = true;
   transposed = tr;
 }
 
 Sigmoid::~Sigmoid() {
-
-  //cout << "Deleting" << endl; //**
-
   if (owned) {
-    if (weights) delete [] weights;
-    if (biases) delete [] biases;
-    if (wDeltas) delete [] wDeltas;
-    if (bDeltas) delete [] bDeltas;
+    if (weights) delete weights;
+    if (biases) delete biases;
   }
-  if (diff) delete [] diff;
+  if (wDeltas) delete wDeltas;
+  if (bDeltas) delete bDeltas;
 }
 
 void Sigmoid::feedForward(const Tensor& input, Tensor& output, Tensor& Zout) {
   int aI = 1;
   if (transposed) aI = 0;
+  // Input may hold several samples as columns, (in, B) -> (out, B)
   multiply(*weights, aI, input, 0, Zout);
-  NTplusEqUnsafe(Zout, *biases);
-  apply(Zout, fnct, output);
+  // Bias and activation (and derivative) in one pass over Zout
+  int rows = biases->size();
+  real *d = 0;
+  if (cacheDerivative) {
+    if (!(dcache.getShape()==Zout.getShape())) dcache.resize(Zout.getShape());
+    d = dcache.getArray();
+  }
+  biasActivate(activation, Zout.getArray(), biases->getArray(), output.getArray(), d, rows, Zout.size()/rows);
 }
 
-void Sigmoid::backPropagate(const Tensor& deltaIn, Tensor& deltaOut, Tensor& Zout) {
-  int aI = 0, d = weights->getCols(); // getRows()
-  if (transposed) {
-    aI = 1;
-    d = weights->getRows();
-  }
-  multiply(*weights, aI, deltaIn, 0, acc);
-  apply(Zout, dfnct, deltaOut);
-  hadamardEq(deltaOut, acc);
+void Sigmoid::backPropagate(const Tensor& deltaIn, Tensor& deltaOut) {
+  int aI = 0;
+  if (transposed) aI = 1;
+  multiply(*weights, aI, deltaIn, 0, deltaOut);
 }
 
-void Sigmoid::updateDeltas(Tensor& Aout, const Tensor& deltas) {
-  multiply(deltas, 1, Aout, 1, *diff);
-  NTplusEqUnsafe(*wDeltas, *diff);
-  NTplusEqUnsafe(*bDeltas, deltas);
+void Sigmoid::backActivation(const Tensor& Aout, Tensor& delta) {
+  // Neither way evaluates an exponential (except softplus from its output)
+  if (cacheDerivative && dcache.getShape()==delta.getShape()) hadamardEq(delta, dcache);
+  else multiplyDerivativeFromOutput(activation, Aout.getArray(), delta.getArray(), delta.size());
 }
 
-void Sigmoid::gradientDescent(double factor) {
-  double mult = 1-L2factor/weights->getCols();
-  timesEq(*weights, mult); // L2 normalization
-  timesEq(*wDeltas, factor);
-  timesEq(*bDeltas, factor);
-  if (transposed) TminusEq(*weights, *wDeltas);
-  else NTminusEqUnsafe(*weights, *wDeltas);
-  NTminusEqUnsafe(*biases, *bDeltas);
+void Sigmoid::updateDeltas(Tensor& Aout, const Tensor& deltas) {
+  // (out, B) x (in, B)^T -> (out, in), summing over the samples in the batch
+  // straight into the accumulated gradient
+  plusEqProduct(*wDeltas, deltas, 1, Aout, 1);
+  plusEqRowSum(*bDeltas, deltas);
 }
 
 inline void Sigmoid::clear() {
@@ -123,3 +109,18 @@ vector<Tensor*> Sigmoid::getCommon() {
   vec.push_back(bDeltas);
   return vec;
 }
+
+vector<Tensor*> Sigmoid::getParameters() {
+  vector<Tensor*> vec;
+  vec.push_back(weights);
+  vec.push_back(biases);
+  return vec;
+}
+
+Neuron* Sigmoid::replicate() {
+  Sigmoid *S = new Sigmoid(*this); // Copies the weight and bias pointers
+  S->wDeltas = new Tensor(wDeltas->getShape());
+  S->bDeltas = new Tensor(bDeltas->getShape());
+  S->owned = false;
+  return S;
+}
@@ -6,36 +6,47 @@
 #define NEURONT_H
 
 #include "Tensor.h"
+#include "Activation.h"
 
 // The sigmoid function is a common function
-inline double sigmoid(double x) {
+inline real sigmoid(real x) {
   return 1.f/(1+exp(-x));
 }
 
-inline double dsigmoid(double x) {
-  double sig = sigmoid(x);
+inline real dsigmoid(real x) {
+  real sig = sigmoid(x);
   return sig*(1-sig);
 }
 
 class Neuron {
  public:
   Neuron(const Shape& inShape, const Shape& outShape);
+  virtual ~Neuron() {};
   virtual void feedForward(const Tensor& input, Tensor& output, Tensor& Zout) = 0;
-  virtual void backPropagate(const Tensor& deltaIn, Tensor& deltaOut, Tensor& Zout) = 0;
+  virtual void backPropagate(const Tensor& deltaIn, Tensor& deltaOut) = 0; // Deltas before the lower layer's activation
+  virtual void backActivation(const Tensor& Aout, Tensor& delta) = 0;      // Multiply by this layer's activation derivative
   virtual void updateDeltas(Tensor& aout, const Tensor& deltas) = 0; // aout not const so we can take the transpose
-  virtual void gradientDescent(double factor) = 0;  
   virtual void clear() = 0;
   virtual void setTensor(int n, Tensor* M) = 0;
   virtual Tensor*& getTensor(int n) = 0;
-  virtual vector<Tensor*> getCommon() = 0;
+  virtual vector<Tensor*> getCommon() = 0;     // The gradient tensors
+  virtual vector<Tensor*> getParameters() = 0; // The tensors the gradients are for, in the same order, weights first
+  virtual bool transposedGradient(int k) { return false; } // Whether getCommon()[k] is shaped like the transpose of its parameter
+  virtual Neuron* replicate() = 0; // A layer sharing this one's weights and biases, with its own gradients
 
   class OutOfBounds {};
 
   Shape getInShape() const { return inShape; }
   Shape getOutShape() const { return outShape; }
+  ActivationType getActivation() const { return activation; }
+  void setActivation(ActivationType a) { activation = a; }
+  // Store f'(z) during feedForward instead of deriving it from the output in backActivation
+  void setCacheDerivative(bool c) { cacheDerivative = c; }
 
  protected:
   Shape inShape, outShape;
+  ActivationType activation;
+  bool cacheDerivative;
 };
 
 class Sigmoid : public Neuron {
@@ -44,13 +55,16 @@ class Sigmoid : public Neuron {
   ~Sigmoid();
 
   virtual void feedForward(const Tensor& input, Tensor& output, Tensor& Zout);
-  virtual void backPropagate(const Tensor& input, Tensor& output, Tensor& Zout);
+  virtual void backPropagate(const Tensor& deltaIn, Tensor& deltaOut);
+  virtual void backActivation(const Tensor& Aout, Tensor& delta);
   virtual void updateDeltas(Tensor& aout, const Tensor& deltas);
-  virtual void gradientDescent(double factor);
   virtual void clear();
   virtual void setTensor(int n, Tensor *M);
   virtual Tensor*& getTensor(int n);
   virtual vector<Tensor*> getCommon();
+  virtual vector<Tensor*> getParameters();
+  virtual bool transposedGradient(int k) { return transposed && k==0; }
+  virtual Neuron* replicate();
 
   void setTransposed(bool t) { transposed = t; }
  protected:
@@ -59,20 +73,13 @@ class Sigmoid : public Neuron {
   Tensor* biases;
   Tensor* wDeltas;
   Tensor* bDeltas;
-  Tensor* diff;
-  Tensor acc;
-  bool owned;
+  Tensor dcache; // f'(z) from the last feedForward, if cacheDerivative is set
+  bool owned; // Whether the weights and biases belong to this layer
   bool transposed;
 
-  double L2factor;
-
   // Input and output shapes
   Shape inShape;
   Shape outShape;
-
-  // Activation function and its derivative
-  double (*fnct) (double);
-  double (*dfnct) (double);
 };
 
 #endif
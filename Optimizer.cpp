@@ -0,0 +1,82 @@
+/// Optimizer.cpp - Fused update kernels for the optimizers
+/// Nathaniel Rupprecht 2016
+///
+/// Each kernel makes one pass over the parameters, the gradients and the state,
+/// and vectorizes. The optimizer classes just pass their settings along.
+///
+
+#include "Optimizer.h"
+
+#include <cmath>
+
+NN_SIMD_CLONES
+static void sgdKernel(real *p, const real *g, int n, real a, real b) {
+  for (int i=0; i<n; i++) p[i] = b*p[i] - a*g[i];
+}
+
+void SGD::update(real *p, const real *g, int n, int offset, real rate, real scale, real decay) {
+  // p -= rate*scale*g + rate*decay*p
+  sgdKernel(p, g, n, rate*scale, 1-rate*decay);
+}
+
+NN_SIMD_CLONES
+static void momentumKernel(real *p, const real *g, real *v, int n, real rate, real scale, real keep, real mu) {
+  for (int i=0; i<n; i++) {
+    v[i] = mu*v[i] - rate*scale*g[i];
+    p[i] = keep*p[i] + v[i];
+  }
+}
+
+NN_SIMD_CLONES
+static void nesterovKernel(real *p, const real *g, real *v, int n, real rate, real scale, real keep, real mu) {
+  for (int i=0; i<n; i++) {
+    real old = v[i];
+    v[i] = mu*old - rate*scale*g[i];
+    p[i] = keep*p[i] + (1+mu)*v[i] - mu*old;
+  }
+}
+
+void Momentum::update(real *p, const real *g, int n, int offset, real rate, real scale, real decay) {
+  if (nesterov) nesterovKernel(p, g, &velocity[offset], n, rate, scale, 1-rate*decay, mu);
+  else momentumKernel(p, g, &velocity[offset], n, rate, scale, 1-rate*decay, mu);
+}
+
+NN_SIMD_CLONES
+static void rmspropKernel(real *p, const real *g, real *s, int n, real rate, real scale, real keep, real rho, real eps) {
+  for (int i=0; i<n; i++) {
+    real grad = scale*g[i];
+    s[i] = rho*s[i] + (1-rho)*grad*grad;
+    p[i] = keep*p[i] - rate*grad/(std::sqrt(s[i])+eps);
+  }
+}
+
+void RMSProp::update(real *p, const real *g, int n, int offset, real rate, real scale, real decay) {
+  rmspropKernel(p, g, &square[offset], n, rate, scale, 1-rate*decay, rho, eps);
+}
+
+NN_SIMD_CLONES
+static void adamKernel(real *p, const real *g, real *m, real *v, int n, real rate, real scale, real keep,
+		       real beta1, real beta2, real eps) {
+  for (int i=0; i<n; i++) {
+    real grad = scale*g[i];
+    m[i] = beta1*m[i] + (1-beta1)*grad;
+    v[i] = beta2*v[i] + (1-beta2)*grad*grad;
+    p[i] = keep*p[i] - rate*m[i]/(std::sqrt(v[i])+eps);
+  }
+}
+
+void Adam::update(real *p, const real *g, int n, int offset, real rate, real scale, real decay) {
+  // Fold the bias corrections into the rate and eps: mhat/(sqrt(vhat)+eps) = c*m/(sqrt(v)+eps*sqrt(1-beta2^t))
+  int t = max(steps, 1);
+  real c1 = 1-pow(beta1, t), c2 = std::sqrt(1-pow(beta2, t));
+  adamKernel(p, g, &first[offset], &second[offset], n, rate*c2/c1, scale, 1-rate*decay, beta1, beta2, eps*c2);
+}
+
+Optimizer* createOptimizer(const string& name) {
+  if (name=="sgd") return new SGD;
+  if (name=="momentum") return new Momentum;
+  if (name=="nesterov") return new Momentum(0.9, true);
+  if (name=="rmsprop") return new RMSProp;
+  if (name=="adam") return new Adam;
+  return 0;
+}
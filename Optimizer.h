@@ -0,0 +1,89 @@
+/// Optimizer.h - Update rules for the network parameters
+/// Nathaniel Rupprecht 2016
+///
+
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "Utility.h"
+
+/// The Network keeps all the parameters in one arena and their gradients at the
+/// same offsets in another, and hands them to the optimizer one contiguous
+/// segment (a layer's weights or biases) at a time. Each update is a single
+/// pass over the parameters, gradients and optimizer state
+class Optimizer {
+ public:
+  virtual ~Optimizer() {};
+
+  /// Allocate (and zero) state for a parameter arena of n entries
+  virtual void setSize(int n) {};
+  /// Called once per step, before the updates of that step
+  virtual void nextStep() {};
+  /// Update the n parameters p from their gradients g, summed over the minibatch.
+  /// The gradient used is scale*g (scale is 1/minibatch size). decay is weight
+  /// decay, applied apart from the optimizer's step as p -= rate*decay*p (as in
+  /// AdamW), so the adaptive optimizers do not divide it by their running scale.
+  /// offset is where p starts in the arena, for per parameter state
+  virtual void update(real *p, const real *g, int n, int offset, real rate, real scale, real decay) = 0;
+  virtual const char* name() const = 0;
+};
+
+/// Plain stochastic gradient descent
+class SGD : public Optimizer {
+ public:
+  virtual void update(real *p, const real *g, int n, int offset, real rate, real scale, real decay);
+  virtual const char* name() const { return "sgd"; }
+};
+
+/// v = mu*v - rate*g, p += v. With nesterov set, p takes the step from the
+/// look-ahead point instead: p += (1+mu)*v - mu*v_old
+class Momentum : public Optimizer {
+ public:
+  Momentum(real mu=0.9, bool nesterov=false) : mu(mu), nesterov(nesterov) {};
+  virtual void setSize(int n) { velocity.assign(n, 0); }
+  virtual void update(real *p, const real *g, int n, int offset, real rate, real scale, real decay);
+  virtual const char* name() const { return nesterov ? "nesterov" : "momentum"; }
+
+ private:
+  real mu;
+  bool nesterov;
+  vector<real> velocity;
+};
+
+/// s = rho*s + (1-rho)*g^2, p -= rate*g/(sqrt(s)+eps)
+class RMSProp : public Optimizer {
+ public:
+  RMSProp(real rho=0.9, real eps=1e-8) : rho(rho), eps(eps) {};
+  virtual void setSize(int n) { square.assign(n, 0); }
+  virtual void update(real *p, const real *g, int n, int offset, real rate, real scale, real decay);
+  virtual const char* name() const { return "rmsprop"; }
+
+ private:
+  real rho, eps;
+  vector<real> square;
+};
+
+/// Adam (Kingma and Ba), with bias corrected first and second moments
+class Adam : public Optimizer {
+ public:
+  Adam(real beta1=0.9, real beta2=0.999, real eps=1e-8) : beta1(beta1), beta2(beta2), eps(eps), steps(0) {};
+  virtual void setSize(int n) {
+    first.assign(n, 0);
+    second.assign(n, 0);
+    steps = 0;
+  }
+  virtual void nextStep() { steps++; }
+  virtual void update(real *p, const real *g, int n, int offset, real rate, real scale, real decay);
+  virtual const char* name() const { return "adam"; }
+
+ private:
+  real beta1, beta2, eps;
+  int steps;
+  vector<real> first, second;
+};
+
+/// Make an optimizer from its name (sgd, momentum, nesterov, rmsprop or adam), with
+/// default settings. Returns 0 for an unknown name
+Optimizer* createOptimizer(const string& name);
+
+#endif
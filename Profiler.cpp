@@ -0,0 +1,85 @@
+/// Profiler.cpp - Implements the Profiler class
+/// Nathaniel Rupprecht 2016
+///
+
+#include "Profiler.h"
+
+void Profiler::reset(int layers, int threads) {
+  nLayers = layers;
+  current.assign(threads, vector<double>(NPhases*nLayers, 0));
+  records.clear();
+  events.assign(threads, vector<Event>());
+}
+
+void Profiler::endEpoch() {
+  if (!on) return;
+  vector<double> sum(NPhases*nLayers, 0);
+  for (auto& C : current)
+    for (int i=0; i<C.size(); i++) {
+      sum[i] += C[i];
+      C[i] = 0;
+    }
+  records.push_back(sum);
+}
+
+double Profiler::time(int epoch, ProfilePhase p, int layer) const {
+  const vector<double>& R = records.at(epoch);
+  if (layer>=0) return R[p*nLayers+layer];
+  double t = 0;
+  for (int i=0; i<nLayers; i++) t += R[p*nLayers+i];
+  return t;
+}
+
+double Profiler::totalTime(ProfilePhase p, int layer) const {
+  double t = 0;
+  for (int e=0; e<epochs(); e++) t += time(e, p, layer);
+  return t;
+}
+
+void Profiler::print(ostream& out) const {
+  out << "Seconds per phase (columns) and layer (rows), over " << epochs() << " epoch(s) and all threads:" << endl;
+  out << "layer";
+  for (int p=0; p<NPhases; p++) out << "\t" << phaseName((ProfilePhase)p);
+  out << endl;
+  for (int i=0; i<nLayers; i++) {
+    out << i;
+    for (int p=0; p<NPhases; p++) out << "\t" << totalTime((ProfilePhase)p, i);
+    out << endl;
+  }
+  out << "all";
+  for (int p=0; p<NPhases; p++) out << "\t" << totalTime((ProfilePhase)p);
+  out << endl;
+}
+
+bool Profiler::writeTrace(const string& fileName, int pid) const {
+  std::ofstream fout(fileName);
+  if (fout.fail()) return false;
+  fout.setf(std::ios::fixed);
+  fout.precision(3);
+  // Complete ("X") events, with times in microseconds
+  fout << "{\"traceEvents\":[";
+  bool first = true;
+  for (int t=0; t<events.size(); t++)
+    for (auto& E : events[t]) {
+      if (!first) fout << ",";
+      first = false;
+      fout << "\n{\"name\":\"" << phaseName(E.phase) << " " << E.layer << "\",\"cat\":\"" << phaseName(E.phase)
+	   << "\",\"ph\":\"X\",\"ts\":" << 1e6*E.begin << ",\"dur\":" << 1e6*(E.end-E.begin)
+	   << ",\"pid\":" << pid << ",\"tid\":" << t << "}";
+    }
+  fout << "\n]}" << endl;
+  return !fout.fail();
+}
+
+const char* Profiler::phaseName(ProfilePhase p) {
+  switch (p) {
+  case DataPhase: return "data";
+  case ForwardPhase: return "forward";
+  case BackwardPhase: return "backward";
+  case GradientPhase: return "gradient";
+  case CommPhase: return "comm";
+  case OptimizerPhase: return "optimizer";
+  case EvalPhase: return "eval";
+  default: return "unknown";
+  }
+}
@@ -0,0 +1,72 @@
+/// Profiler.h - Where the training time goes, per phase and per layer
+/// Nathaniel Rupprecht 2016
+///
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "Utility.h"
+
+#include <chrono>
+
+/// The phases of a training step. Layer 0 stands for work that belongs to no
+/// single layer (e.g. allreducing the whole gradient arena)
+enum ProfilePhase { DataPhase, ForwardPhase, BackwardPhase, GradientPhase, CommPhase, OptimizerPhase, EvalPhase, NPhases };
+
+/// Adds up wall clock (steady_clock) time per phase, layer and thread, and keeps
+/// the totals of every epoch. Each thread only touches its own accumulators, so
+/// the timed code needs no locks. When tracing, every timed interval is also kept
+/// so that it can be written out as a Chrome trace (chrome://tracing or Perfetto)
+class Profiler {
+ public:
+  Profiler() : on(false), tracing(false), nLayers(0), origin(std::chrono::steady_clock::now()) {};
+
+  void setEnabled(bool e) { on = e; }
+  void setTracing(bool t) { tracing = t; }
+  bool enabled() const { return on; }
+
+  /// Clear everything and set up accumulators for a number of layers and threads
+  void reset(int layers, int threads);
+  /// Returns the time to pass to stop, or 0 if profiling is off
+  double start() const { return on ? now() : 0; }
+  /// Add the time since [begin] to a phase of a layer on a thread
+  void stop(ProfilePhase p, int layer, double begin, int thread=0) {
+    if (!on) return;
+    double end = now();
+    current[thread][p*nLayers+layer] += end-begin;
+    if (tracing) events[thread].push_back(Event{begin, end, p, layer});
+  }
+  /// Seconds since the profiler was created
+  double now() const { return std::chrono::duration<double>(std::chrono::steady_clock::now()-origin).count(); }
+  /// Sum the accumulators of all the threads into a new epoch record, and zero them
+  void endEpoch();
+
+  int epochs() const { return records.size(); }
+  /// Seconds spent in a phase in an epoch, for one layer or (layer -1) for all of them,
+  /// added up over the threads
+  double time(int epoch, ProfilePhase p, int layer=-1) const;
+  /// The same, over all the epochs
+  double totalTime(ProfilePhase p, int layer=-1) const;
+  /// A table of the total time per phase and layer
+  void print(ostream& out) const;
+  /// Write the traced intervals as a Chrome trace. pid tells processes apart
+  bool writeTrace(const string& fileName, int pid=0) const;
+
+  static const char* phaseName(ProfilePhase p);
+
+ private:
+  struct Event {
+    double begin, end;
+    ProfilePhase phase;
+    int layer;
+  };
+
+  bool on, tracing;
+  int nLayers;
+  std::chrono::steady_clock::time_point origin;
+  vector<vector<double>> current; // [thread][phase*nLayers+layer], for the epoch in progress
+  vector<vector<double>> records; // [epoch][phase*nLayers+layer]
+  vector<vector<Event>> events;   // [thread]
+};
+
+#endif
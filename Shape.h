@@ -8,49 +8,43 @@
 #include "Utility.h"
 
 struct Shape {
-  Shape() : rank(0), total(0), dims(0) {};
-  
-  template<typename ... T> Shape(int first, T ...s) {
-    vector<int> vect;
-    unpack(vect, first, s...);
-    rank = vect.size();
+  // Shapes with at most this many dimensions keep them inside the object, so
+  // copying them does not allocate. Larger ranks fall back to the heap
+  static const int inlineRank = 8;
+
+  Shape() : rank(0), dims(inlineDims), total(0) {};
+
+  template<typename ... T> Shape(int first, T ...s) : rank(0), dims(inlineDims) {
+    setRank(1+sizeof...(s));
+    unpack(0, first, s...);
     if (rank > 0) {
-      dims = new int[rank];
       total = 1;
-      for (int i=0; i<rank; i++) {
-        dims[i] = vect.at(i);
-        total *= dims[i];
-      }
-    }
-    else {
-      dims = 0;
-      total = 0;
+      for (int i=0; i<rank; i++) total *= dims[i];
     }
+    else total = 0;
   }
 
-  Shape(const Shape& s) : dims(0) { *this = s; }
+  Shape(const Shape& s) : rank(0), dims(inlineDims) { *this = s; }
 
   Shape& operator=(const Shape& s) {
+    if (&s==this) return *this;
     // Copy data, not pointers
-    rank = s.rank;
+    setRank(s.rank);
     total = s.total;
-    if (dims) delete [] dims;
-    dims = new int[rank];
     for (int i=0; i<rank; i++) dims[i] = s.dims[i];
     return *this;
   }
-    
-  ~Shape() { 
-    if(dims) delete [] dims; 
+
+  ~Shape() {
+    if (dims!=inlineDims) delete [] dims;
   }
 
   friend Shape operator+(const Shape& A, const Shape& B) {
     int rank = A.rank+B.rank;
     Shape S;
-    S.rank = rank;
+    S.setRank(rank);
     int i;
     // Set dims
-    S.dims = new int[rank];
     for (i=0; i<A.rank; i++) S.dims[i] = A.dims[i];
     for (int k=0; i<rank; i++, k++) S.dims[i] = B.dims[k];
     // Compute total
@@ -89,22 +83,29 @@ struct Shape {
     if (i<0 || i>=rank) throw ShapeOutOfBounds();
     return dims[i];
   }
-  
+
   // Error classes
   class ShapeOutOfBounds {};
 
   int rank;
-  int* dims;
+  int* dims; // Points to inlineDims unless rank > inlineRank
 
 private:
   // Helper functions
-  static void unpack(vector<int>&) {};
-  template <typename ... T> static void unpack(vector<int>& vect, int first, T ... last) {
-    vect.push_back(first);
-    unpack(vect, last...);
+  void setRank(int r) {
+    if (r==rank) return;
+    if (dims!=inlineDims) delete [] dims;
+    dims = r>inlineRank ? new int[r] : inlineDims;
+    rank = r;
+  }
+  void unpack(int) {};
+  template <typename ... T> void unpack(int i, int first, T ... last) {
+    dims[i] = first;
+    unpack(i+1, last...);
   }
 
   int total;
+  int inlineDims[inlineRank];
 };
 
 #endif
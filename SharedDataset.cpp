@@ -0,0 +1,60 @@
+/// SharedDataset.cpp - Implements the SharedDataset class
+/// Nathaniel Rupprecht 2016
+///
+
+#include "SharedDataset.h"
+
+#include <string.h> // For memcpy
+
+SharedDataset::SharedDataset(MPI_Comm comm) : win(MPI_WIN_NULL) {
+  MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node);
+  MPI_Comm_rank(node, &nodeRank);
+}
+
+SharedDataset::~SharedDataset() {
+  int finalized;
+  MPI_Finalized(&finalized);
+  if (finalized) return; // Too late, the memory goes with the process
+  free();
+  MPI_Comm_free(&node);
+}
+
+void SharedDataset::share(const ByteDataset& data) {
+  free();
+  // Everyone needs the leader's shapes and scaling
+  long long shape[3] = {data.size(), data.inputSize(), data.hasLabels() ? data.getClasses() : 0};
+  double scaling[2] = {data.getScale(), data.getShift()};
+  MPI_Bcast(shape, 3, MPI_LONG_LONG, 0, node);
+  MPI_Bcast(scaling, 2, MPI_DOUBLE, 0, node);
+  long long samples = shape[0], sampleSize = shape[1], classes = shape[2];
+  MPI_Aint inputBytes = samples*sampleSize, bytes = inputBytes + (classes>0 ? samples : 0);
+
+  // The leader allocates all of it, the others map the leader's part
+  uchar *base;
+  MPI_Win_allocate_shared(isLeader() ? bytes : 0, 1, MPI_INFO_NULL, node, &base, &win);
+  if (!isLeader()) {
+    MPI_Aint size;
+    int unit;
+    MPI_Win_shared_query(win, 0, &size, &unit, &base);
+  }
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+  if (isLeader() && samples>0) {
+    memcpy(base, data.getInput(0), inputBytes);
+    for (int i=0; i<samples && classes>0; i++) base[inputBytes+i] = data.getLabel(i);
+  }
+  // Make the leader's writes visible to the others
+  MPI_Win_sync(win);
+  MPI_Barrier(node);
+  MPI_Win_sync(win);
+  MPI_Win_unlock_all(win);
+
+  dataset.setInputs(base, samples, sampleSize, false);
+  if (classes>0) dataset.setLabels(base+inputBytes, classes, false);
+  dataset.setScale(scaling[0], scaling[1]);
+}
+
+void SharedDataset::free() {
+  dataset = ByteDataset();
+  if (win!=MPI_WIN_NULL) MPI_Win_free(&win);
+  win = MPI_WIN_NULL;
+}
@@ -0,0 +1,42 @@
+/// SharedDataset.h - A byte dataset kept once per node, shared by its MPI processes
+/// Nathaniel Rupprecht 2016
+///
+
+#ifndef SHARED_DATASET_H
+#define SHARED_DATASET_H
+
+#include <mpi.h>
+
+#include "Dataset.h"
+
+/// Holds a ByteDataset in an MPI-3 shared memory window. Only the first process
+/// of each node needs to load the data; share copies it into the window, and every
+/// process on the node then reads the samples from there. Memory per node no longer
+/// grows with the number of processes. Free it (or let it go out of scope) before
+/// MPI_Finalize
+class SharedDataset {
+ public:
+  /// Collective over comm
+  SharedDataset(MPI_Comm comm=MPI_COMM_WORLD);
+  ~SharedDataset();
+
+  /// Whether this process is the one on its node that must load the data
+  bool isLeader() const { return nodeRank==0; }
+  /// Collective over the node. The leader passes the loaded data, which it may
+  /// free afterwards, the other processes' argument is ignored
+  void share(const ByteDataset& data);
+  void free();
+
+  const ByteDataset& getDataset() const { return dataset; }
+
+ private:
+  SharedDataset(const SharedDataset&);            // Not copyable, it owns the window
+  SharedDataset& operator=(const SharedDataset&);
+
+  MPI_Comm node; // The processes on this node
+  int nodeRank;
+  MPI_Win win;
+  ByteDataset dataset; // Refers to the window
+};
+
+#endif
@@ -1,38 +1,49 @@
 #include "Tensor.h"
 
-Tensor::Tensor(Shape s) {
+Tensor::Tensor(Shape s) : array(0), external(false), total(0), capacity(0), stride(strideBuf) {
   initialize(s);
 }
 
-Tensor::Tensor(const Tensor& T) {
-  initialize(T.shape);
+Tensor::Tensor(const Tensor& T) : array(0), external(false), total(0), capacity(0), stride(strideBuf) {
+  initialize(T.shape, true, false);
   for (int i=0; i<total; i++) array[i] = T.array[i];
 }
 
+Tensor::Tensor(Tensor&& T) : array(T.array), external(T.external), total(T.total), capacity(T.capacity), stride(strideBuf), shape(T.shape) {
+  takeStride(T);
+  T.array = 0;
+  T.external = false;
+  T.total = T.capacity = 0;
+}
+
 Tensor::~Tensor() {
-  if (array) delete [] array;
-  if (stride) delete [] stride;
+  if (array && !external) delete [] array;
+  if (stride!=strideBuf) delete [] stride;
 }
 
 Tensor& Tensor::operator=(const Tensor& T) {
-  if (T.total!=total && array) delete [] array; // Need a new array
-  if (stride) delete [] stride;
-  
-  initialize(T.shape);
+  if (&T==this) return *this;
+  // Reuses the array if it is large enough
+  initialize(T.shape, true, false);
   // Set values
   for (int i=0; i<total; i++) array[i] = T.array[i];
+  return *this;
 }
 
-/*
-Tensor& Tensor::operator=(const Tensor&& T) {
-  if (array) delete [] array;
-  if (stride) delete [] stride;
+Tensor& Tensor::operator=(Tensor&& T) {
+  if (&T==this) return *this;
+  if (array && !external) delete [] array;
   array = T.array;
-  stride = T.stride;
+  external = T.external;
   shape = T.shape;
   total = T.total;
+  capacity = T.capacity;
+  takeStride(T);
+  T.array = 0;
+  T.external = false;
+  T.total = T.capacity = 0;
+  return *this;
 }
-*/
 
 Tensor Tensor::shift(const Shape& shift) const {
   Tensor T(shape); // Same shape, shift entries
@@ -42,7 +53,7 @@ Tensor Tensor::shift(const Shape& shift) const {
   return T;
 }
 
-void Tensor::set(double value, vector<int> indices, const Shape& shift) {
+void Tensor::set(real value, vector<int> indices, const Shape& shift) {
   if (indices.size()!=shape.rank || shift.rank!=shape.rank) return;
   for (int i=0; i<indices.size(); i++) {
     int& add = indices.at(i) = indices.at(i)+shift.at(i);
@@ -51,11 +62,20 @@ void Tensor::set(double value, vector<int> indices, const Shape& shift) {
   at(indices) = value;
 }
 
-void multiply(const Tensor& A, int aI, const Tensor& B, int bI, Tensor& C) {
+/// Contract index aI of A with index bI of B. The indices of C are the remaining
+/// indices of A followed by the remaining indices of B. A is viewed as (pA, K, qA)
+/// and B as (pB, K, qB), so the contraction is the single matrix product
+/// (pA*qA, K) x (K, pB*qB) -> C. An operand whose contracted index is already
+/// first or last is handed to gemm in place (possibly transposed), otherwise it
+/// is permuted into a scratch buffer first.
+/// C = beta*C + the contraction of index aI of A with index bI of B
+void Tensor::contract(const Tensor& A, int aI, const Tensor& B, int bI, Tensor& C, real beta) {
   // Check index correctness
-  if (aI>=A.shape.rank || bI>=B.shape.rank) throw Tensor::TensorBadContraction();
+  if (aI<0 || bI<0 || aI>=A.shape.rank || bI>=B.shape.rank) throw Tensor::TensorBadContraction();
+  if (A.shape.dims[aI]!=B.shape.dims[bI]) throw Tensor::TensorBadContraction();
   // Check Matrix compatability
   if (A.shape.rank + B.shape.rank - 2 != C.shape.rank) throw Tensor::TensorRankMismatch();
+  if (C.shape.rank==0) throw Tensor::TensorBadContraction(); // No rank 0 tensors
 
   int i, j;
   for (i=0, j=0; i<A.shape.rank; i++) {
@@ -69,71 +89,78 @@ void multiply(const Tensor& A, int aI, const Tensor& B, int bI, Tensor& C) {
     j++;
   }
 
-  // Special case - (m,k) times (k,n) -> (m, n)
-  if (A.shape.rank==2 && B.shape.rank==2) { // Normal matrix multiplication
-    int m, n, k, ac, bc, cc;
+  // Flatten the indices before and after the contracted ones
+  int K = A.shape.dims[aI];
+  int pA = 1, qA = 1, pB = 1, qB = 1;
+  for (i=0; i<aI; i++) pA *= A.shape.dims[i];
+  for (i=aI+1; i<A.shape.rank; i++) qA *= A.shape.dims[i];
+  for (i=0; i<bI; i++) pB *= B.shape.dims[i];
+  for (i=bI+1; i<B.shape.rank; i++) qB *= B.shape.dims[i];
+  int m = pA*qA, n = pB*qB;
+
+  // Get A as an (m, K) matrix
+  vector<real> aBuf;
+  const real *a = A.array;
+  BlasTranspose AT = BlasNoTrans;
+  int lda = K;
+  if (qA==1) {} // A is already (m, K)
+  else if (pA==1) { // A is (K, m), "transposed"
+    AT = BlasTrans;
+    lda = m;
+  }
+  else { // Move the contracted index to the end
+    aBuf.resize(m*K);
+    for (i=0; i<pA; i++)
+      for (int k=0; k<K; k++) {
+        const real *src = &A.array[(i*K+k)*qA];
+        real *dst = &aBuf[i*qA*K+k];
+        for (j=0; j<qA; j++) dst[j*K] = src[j];
+      }
+    a = aBuf.data();
+  }
 
-    auto AT = CblasTrans;
-    if (aI==0) { // A is "transposed"
-      m = A.shape.dims[1];
-      k = A.shape.dims[0];
-    }
-    else {
-      m = A.shape.dims[0];
-      k = A.shape.dims[1];
-      AT = CblasNoTrans;
-    }
-    ac = A.shape.dims[1];
+  // Get B as a (K, n) matrix
+  vector<real> bBuf;
+  const real *b = B.array;
+  BlasTranspose BT = BlasNoTrans;
+  int ldb = n;
+  if (pB==1) {} // B is already (K, n)
+  else if (qB==1) { // B is (n, K), "transposed"
+    BT = BlasTrans;
+    ldb = K;
+  }
+  else { // Move the contracted index to the front
+    bBuf.resize(K*n);
+    for (i=0; i<pB; i++)
+      for (int k=0; k<K; k++) {
+        const real *src = &B.array[(i*K+k)*qB];
+        real *dst = &bBuf[k*n+i*qB];
+        for (j=0; j<qB; j++) dst[j] = src[j];
+      }
+    b = bBuf.data();
+  }
 
-    auto BT = CblasNoTrans;
-    if (bI==0) n = B.shape.dims[1]; // B not "transposed"
-    else {
-      n = B.shape.dims[0];
-      BT = CblasTrans;
-    }
-    bc = B.shape.dims[1];
-    cc = C.shape.dims[1];
-    double ALPHA = 1.0, BETA = 0;
+  real ALPHA = 1.0;
+  gemm(AT, BT, m, n, K, ALPHA, a, lda, b, ldb, beta, C.array, n);
+}
 
-    cblas_dgemm(CblasRowMajor, AT, BT, m, n, k, ALPHA, A.array, ac, B.array, bc, BETA, C.array, cc);
-    return;
-  }
-  if (A.shape.rank==2 && B.shape.rank==1) { // Matrix times vector (k)->(k,1)
-    int m, n, k, ac, bc, cc;
-    auto AT = CblasTrans;
-    if (aI==0) { // A is "transposed"
-      m = A.shape.dims[1];
-      k = A.shape.dims[0];
-    }
-    else {
-      m = A.shape.dims[0];
-      k = A.shape.dims[1];
-      AT = CblasNoTrans;
-    }
-    ac = A.shape.dims[1];
-    auto BT = CblasNoTrans;
-    n = bc = cc = 1;
-    double ALPHA = 1.0, BETA = 0;
+void multiply(const Tensor& A, int aI, const Tensor& B, int bI, Tensor& C) {
+  Tensor::contract(A, aI, B, bI, C, 0);
+}
 
-    cblas_dgemm(CblasRowMajor, AT, BT, m, n, k, ALPHA, A.array, ac, B.array, bc, BETA, C.array, cc);
-    return;
-  }
-  
-  // STUB
-  
-  
-  
+void plusEqProduct(Tensor& C, const Tensor& A, int aI, const Tensor& B, int bI) {
+  Tensor::contract(A, aI, B, bI, C, 1);
 }
 
 void multiply(const Tensor& A, const Tensor& B, Tensor& C) {
   multiply(A, A.shape.rank-1, B, 0, C);
 }
 
-void multiply(const double m, const Tensor& A, const Tensor& B) {
+void multiply(const real m, const Tensor& A, const Tensor& B) {
   for (int i=0; i<A.total; i++) B.array[i] = m*A.array[i];
 }
 
-void timesEq(Tensor& A, const double m) {
+void timesEq(Tensor& A, const real m) {
   for (int i=0; i<A.total; i++) A.array[i] *= m;
 }
 
@@ -142,7 +169,7 @@ void add(const Tensor &A, const Tensor& B, Tensor& C) {
   for (int i=0; i<A.total; i++) C.array[i] = A.array[i] + B.array[i];
 }
 
-void NTplusEqUnsafe(Tensor& A, const Tensor& B, double mult) {
+void NTplusEqUnsafe(Tensor& A, const Tensor& B, real mult) {
   for (int i=0; i<A.total; i++) A.array[i] += mult*B.array[i];
 }
 
@@ -151,11 +178,11 @@ void subtract(const Tensor &A, const Tensor& B, Tensor& C) {
   for (int i=0; i<A.total; i++) C.array[i] = A.array[i] - B.array[i];
 }
 
-void NTminusEqUnsafe(Tensor& A, const Tensor& B, double mult) {
+void NTminusEqUnsafe(Tensor& A, const Tensor& B, real mult) {
   for (int i=0;i<A.total; i++) A.array[i] -= mult*B.array[i];
 }
 
-void TminusEq(Tensor& A, const Tensor& B, double mult) {
+void TminusEq(Tensor& A, const Tensor& B, real mult) {
   // Do checks
   if (A.shape.rank!=2 || B.shape.rank!=2) throw Tensor::TensorBadFunction();
   if (A.shape.dims[0]!=B.shape.dims[1] || A.shape.dims[1]!=B.shape.dims[0])
@@ -181,15 +208,24 @@ void apply(const Tensor& A, function F, Tensor& C) {
   for (int i=0; i<A.total; i++) C.array[i] = F(A.array[i]);
 }
 
+void plusEqRowSum(Tensor& v, const Tensor& A) {
+  int rows = A.getRows(), cols = A.getCols();
+  if (v.total!=rows) throw Tensor::TensorDimsMismatch();
+  for (int i=0; i<rows; i++) {
+    real sum = 0;
+    const real *row = &A.array[i*cols];
+    for (int j=0; j<cols; j++) sum += row[j];
+    v.array[i] += sum;
+  }
+}
+
 int Tensor::getDim(int i) {
   if (i<0 || i>shape.rank) throw TensorRankMismatch();
   return shape.dims[i];
 }
 
 void Tensor::resize(const Shape& s) {
-  if (array) delete [] array;
-  if (stride) delete [] stride;
-  *this = Tensor(s);
+  initialize(s);
 }
 
 void Tensor::reshape(const Shape& s) {
@@ -198,7 +234,7 @@ void Tensor::reshape(const Shape& s) {
   initialize(s, false);
 }
 
-void Tensor::random(double max) {
+void Tensor::random(real max) {
   for (int i=0; i<total; i++)
     array[i] = max*(2*drand48()-1);
 }
@@ -209,11 +245,27 @@ void Tensor::zero() {
 
 void Tensor::qrel() {
   array = 0;
+  capacity = 0;
+  external = false;
 }
 
 void Tensor::qref(Tensor& T) {
-  if (array) delete [] array;
+  if (array && !external) delete [] array;
   array = T.array;
+  capacity = 0; // Not ours
+  external = true;
+}
+
+/// Use the [s] shaped block at [data] as our entries, e.g. to make this tensor a
+/// view into an array holding many tensors. The entries are left alone. The
+/// memory must outlive the tensor, which keeps using it until it is resized to
+/// more entries than the view holds
+void Tensor::view(real *data, const Shape& s) {
+  if (array && !external) delete [] array;
+  array = data;
+  external = true;
+  initialize(s, false);
+  capacity = total;
 }
 
 inline void Tensor::writeHelper(vector<int> indices, std::ostream& out, const Tensor& T) {
@@ -244,22 +296,17 @@ std::ostream& operator<<(std::ostream& out, const Tensor& T) {
   return out;
 }
 
-void Tensor::initialize(Shape s, bool del, bool zero, int tot) {
+/// Set the shape and strides. If del is true, make sure the array can hold the
+/// entries (only allocating if the current capacity is too small), and zero
+/// them if zero is true. Otherwise the array is left alone, as in reshape
+void Tensor::initialize(const Shape& s, bool del, bool zero, int tot) {
+  setStrideRank(s.rank);
   shape = s;
 
   // Find total
   total = s.getTotal();
-  /*
-  if (tot==-1) {
-    total = 1;
-    for (int i=0; i<shape.rank; i++) total *= shape.dims[i];
-  }
-  else total = tot;
-  */
 
-  // Set stride array
   int count = 1;
-  stride = new int[shape.rank];
   for (int i=0; i<shape.rank; i++) {
     count *= shape.dims[i];
     stride[i] = total/count;
@@ -267,16 +314,41 @@ void Tensor::initialize(Shape s, bool del, bool zero, int tot) {
 
   if (del) {
     // Set data array
-    array = new double[total];
+    if (total>capacity) {
+      if (array && !external) delete [] array;
+      array = new real[total];
+      capacity = total;
+      external = false;
+    }
     if (zero) for (int i=0; i<total; i++) array[i] = 0.;
   }
 }
 
+/// Make the stride array hold r entries. Uses strideBuf unless r is too large
+inline void Tensor::setStrideRank(int r) {
+  if (r==shape.rank) return;
+  if (stride!=strideBuf) delete [] stride;
+  stride = r>Shape::inlineRank ? new int[r] : strideBuf;
+}
+
+/// Take T's strides, leaving T with an empty shape
+inline void Tensor::takeStride(Tensor& T) {
+  if (stride!=strideBuf) delete [] stride;
+  if (T.stride==T.strideBuf) {
+    stride = strideBuf;
+    for (int i=0; i<T.shape.rank; i++) stride[i] = T.stride[i];
+  }
+  else stride = T.stride;
+  T.stride = T.strideBuf;
+  T.shape = Shape();
+}
+
 inline bool Tensor::checkDims(const Tensor& A, const Tensor& B) {
   if (A.shape.rank != B.shape.rank) throw TensorRankMismatch();
   for (int i=0; i<A.shape.rank; i++) 
     if (A.shape.dims[i]!=B.shape.dims[i])
       throw TensorDimsMismatch();
+  return true;
 }
 
 inline void Tensor::shift_helper(const Shape& shift, vector<int>& point, Tensor& T) const {
@@ -284,7 +356,7 @@ inline void Tensor::shift_helper(const Shape& shift, vector<int>& point, Tensor&
   if (shape.rank-1==iter) {
     for (int i=0; i<shape.dims[iter]; i++) {
       point.push_back(i);
-      double value = at(point);
+      real value = at(point);
       T.set(value, point, shift);
       point.pop_back();
     }
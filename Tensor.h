@@ -17,52 +17,59 @@ struct Index {
   int index;
 };
 
+// Default arguments can only be given outside of friend declarations
+class Tensor;
+void NTplusEqUnsafe(Tensor& A, const Tensor& B, real mult=1);
+void NTminusEqUnsafe(Tensor& A, const Tensor& B, real mult=1);
+void TminusEq(Tensor& A, const Tensor& B, real mult=1);
+
 /// Tensor class
 class Tensor {
  public:
- Tensor() : array(0), total(0), stride(0), shape(Shape()) {};
+ Tensor() : array(0), external(false), total(0), capacity(0), stride(strideBuf), shape(Shape()) {};
   Tensor(Shape s);
-  template<typename ...T> Tensor(int first, T... last) {
+  template<typename ...T> Tensor(int first, T... last) : array(0), external(false), total(0), capacity(0), stride(strideBuf) {
     Shape s(first, last...);
     initialize(s);
   }
   Tensor(const Tensor& T);
+  Tensor(Tensor&& T);
   ~Tensor();
 
   Tensor& operator=(const Tensor& T);
-  //Tensor& operator=(const Tensor&& T);
+  Tensor& operator=(Tensor&& T);
   
   Tensor shift(const Shape& shft) const;
 
   // "at" function
-  double& at(uint i) {
+  real& at(uint i) {
     if (shape.dims[0]<=i || i<0) throw TensorDimsMismatch();
     return array[i*stride[0]];
   }
-  template<typename ...T> double& at(uint first, T ...s) {
+  template<typename ...T> real& at(uint first, T ...s) {
     int address = 0;
     at_address(address, 0, first, s...);    
     return array[address];
   }
 
-  double at(uint i) const { 
+  real at(uint i) const { 
     if (shape.dims[0]<=i || i<0) throw TensorDimsMismatch();
     return array[i*stride[0]]; 
   }
-  template<typename ...T> double at(uint first, T ...s) const {
+  template<typename ...T> real at(uint first, T ...s) const {
     int address = 0;
     at_address(address, 0, first, s...);    
     return array[address];
   }
 
-  double& at(vector<int> indices) {
+  real& at(vector<int> indices) {
     if (indices.size()>shape.rank) throw TensorRankMismatch();
     int add = 0;
     for (int i=0; i<shape.rank; i++)
       add += stride[i]*indices.at(i);
     return array[add];
   }
-  double at(vector<int> indices) const {
+  real at(vector<int> indices) const {
     if (indices.size()>shape.rank) throw TensorRankMismatch();
     int add = 0;
     for (int i=0; i<shape.rank; i++)
@@ -70,7 +77,7 @@ class Tensor {
     return array[add];
   }
 
-  void set(double value, vector<int> indices, const Shape& shift);
+  void set(real value, vector<int> indices, const Shape& shift);
 
   /// Special (matrix type) accessors
   int getRows() const {
@@ -81,21 +88,24 @@ class Tensor {
   int getCols() const { return shape.dims[shape.rank-1]; }
 
   /// Dangerous
-  double* getArray() { return array; }
+  real* getArray() { return array; }
+  const real* getArray() const { return array; }
 
   /// Arithmetic functions
   friend void multiply(const Tensor& A, int aI, const Tensor& B, int bI, Tensor& C);
+  friend void plusEqProduct(Tensor& C, const Tensor& A, int aI, const Tensor& B, int bI); // C += the product, no temporary
   friend void multiply(const Tensor& A, const Tensor& B, Tensor& C);
-  friend void multiply(const double m, const Tensor& A, const Tensor& B);
-  friend void timesEq(Tensor& A, const double m);
+  friend void multiply(const real m, const Tensor& A, const Tensor& B);
+  friend void timesEq(Tensor& A, const real m);
   friend void add(const Tensor& A, const Tensor& B, Tensor& C);
-  friend void NTplusEqUnsafe(Tensor& A, const Tensor& B, double mult=1.);
+  friend void NTplusEqUnsafe(Tensor& A, const Tensor& B, real mult);
   friend void subtract(const Tensor&A, const Tensor& B, Tensor& C);
-  friend void NTminusEqUnsafe(Tensor& A, const Tensor& B, double mult=1.);
-  friend void TminusEq(Tensor& A, const Tensor& B, double mult=1.);
+  friend void NTminusEqUnsafe(Tensor& A, const Tensor& B, real mult);
+  friend void TminusEq(Tensor& A, const Tensor& B, real mult);
   friend void hadamard(const Tensor&A, const Tensor& B, Tensor& C);
   friend void hadamardEq(Tensor& A, const Tensor& B);
   friend void apply(const Tensor& A, function F, Tensor& C);
+  friend void plusEqRowSum(Tensor& v, const Tensor& A);    // Add the sum of the columns of A to v
 
   /// Accessors
   int size() const { return total; }     // Does the same thing as getTotal()
@@ -103,12 +113,12 @@ class Tensor {
   int getRank() { return shape.rank; }
   int getDim(int i);
   Shape getShape() const { return shape; }
+  int getCapacity() const { return capacity; }
 
-  // resize - Change the rank/dimensions of a tensor
+  // resize - Change the rank/dimensions of a tensor. The array is only
+  // reallocated if the new size does not fit in the current capacity
   template<typename ...T> void resize(int first, T... last) {
-    if (array) delete [] array;
-    if (stride) delete [] stride;
-    *this = Tensor(first, last...);
+    resize(Shape(first, last...));
   };
   void resize(const Shape& s);
   // reshape - Reinterpret the rank/dimensions of a tensor
@@ -120,12 +130,13 @@ class Tensor {
   };
   void reshape(const Shape& s);
 
-  void random(double max=1); // Written
+  void random(real max=1); // Written
   void zero();
   
   /// Quick handling of tensors
   void qrel();          // Release array memory
   void qref(Tensor& T); // Reference this tensor's array
+  void view(real *data, const Shape& s); // Use memory we do not own, e.g. part of a larger array
 
   /// Error classes
   class TensorOutOfBounds {};
@@ -140,7 +151,10 @@ class Tensor {
 
  private:
   /// Helper functions
-  void initialize(Shape s, bool del=true, bool zero=true, int tot=-1);
+  void initialize(const Shape& s, bool del=true, bool zero=true, int tot=-1);
+  inline void setStrideRank(int r);
+  inline void takeStride(Tensor& T);
+  static void contract(const Tensor& A, int aI, const Tensor& B, int bI, Tensor& C, real beta);
   template<typename ...T> void at_address(int&, int) const {};
   template<typename ...T> void at_address(int& add, int step, int first, T ... last) const {
     if (step>=shape.rank || first>=shape.dims[step]) throw TensorOutOfBounds();
@@ -154,9 +168,12 @@ class Tensor {
   
   /// Data
   Shape shape; // The shape of the tensor
-  int *stride; // The stride for each dimension
+  int *stride; // The stride for each dimension, points to strideBuf for small ranks
+  int strideBuf[Shape::inlineRank];
   int total;   // The total number of entries
-  double *array; // The entries of the tensor
+  int capacity; // The number of entries the array can hold
+  real *array; // The entries of the tensor
+  bool external; // Whether the array belongs to someone else (a view), so we must not delete it
 };
 
 #endif
@@ -0,0 +1,57 @@
+/// ThreadPool.cpp - Implements the ThreadPool class
+/// Nathaniel Rupprecht 2016
+///
+
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int n) : nThreads(n<1 ? 1 : n), current(0), generation(0), running(0), quit(false) {
+  for (int t=1; t<nThreads; t++)
+    threads.push_back(std::thread(&ThreadPool::work, this, t));
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    quit = true;
+  }
+  start.notify_all();
+  for (auto& T : threads) T.join();
+}
+
+void ThreadPool::run(const std::function<void(int)>& job) {
+  if (nThreads==1) {
+    job(0);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    current = &job;
+    running = nThreads-1;
+    generation++;
+  }
+  start.notify_all();
+  job(0);
+  std::unique_lock<std::mutex> guard(lock);
+  done.wait(guard, [this] { return running==0; });
+  current = 0;
+}
+
+void ThreadPool::work(int t) {
+  int seen = 0;
+  while (true) {
+    const std::function<void(int)> *job;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      start.wait(guard, [&] { return quit || generation!=seen; });
+      if (quit) return;
+      seen = generation;
+      job = current;
+    }
+    (*job)(t);
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      running--;
+    }
+    done.notify_one();
+  }
+}
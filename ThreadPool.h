@@ -0,0 +1,39 @@
+/// ThreadPool.h - A fixed set of threads for fork-join parallel loops
+/// Nathaniel Rupprecht 2016
+///
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+
+/// Runs a job on n threads and waits for all of them. The calling thread is
+/// thread 0, so a pool of 1 starts no threads at all. The threads sleep between
+/// jobs rather than being created for each one
+class ThreadPool {
+ public:
+  ThreadPool(int n=1);
+  ~ThreadPool();
+
+  /// Calls job(t) for t = 0, ..., size()-1, one per thread, and returns when all are done
+  void run(const std::function<void(int)>& job);
+  int size() const { return nThreads; }
+
+ private:
+  void work(int t);
+
+  int nThreads;
+  std::vector<std::thread> threads;
+  std::mutex lock;
+  std::condition_variable start, done;
+  const std::function<void(int)> *current; // The job being run
+  int generation; // Incremented for every job, so threads can tell a new job from a spurious wakeup
+  int running;    // Threads still working on the current job
+  bool quit;
+};
+
+#endif
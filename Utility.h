@@ -1,8 +1,7 @@
 #ifndef UTILITY_H
 #define UTILITY_H
 
-/// For use with the CRC
-#include"/afs/crc.nd.edu/x86_64_linux/intel/15.0/mkl/include/mkl.h"
+#include "Blas.h"    // For gemm, the backend is chosen at build time
 
 #include <math.h>   // For sqrt
 #include <stdlib.h> // For drand48
@@ -27,13 +26,33 @@ using std::ostream;
 using std::cout;
 using std::endl;
 
+// The element type of tensors, set with PRECISION in the makefile
+#ifdef NN_FLOAT
+typedef float real;
+#else
+typedef double real;
+#endif
+
+// Compile a vectorizable loop for AVX-512, AVX2 and plain x86-64, and pick the
+// best one at run time (gcc only)
+#if defined(__GNUC__) && !defined(__INTEL_COMPILER) && !defined(__clang__) && defined(__x86_64__)
+#define NN_SIMD_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define NN_SIMD_CLONES
+#endif
+
 // Common function template
-typedef double (*function) (double);
+typedef real (*function) (real);
 
 // Min/Max functions
 template<typename T> T min(T a, T b) { return a<b?a:b; }
 template<typename T> T max(T a, T b) { return a<b?b:a; }
 
+template<typename T, typename U> ostream& operator<<(ostream& out, pair<T, U> P) {
+  out << "{" << P.first << "," << P.second << "}";
+  return out;
+}
+
 template<typename T> string print(const vector<T>& array) {
   if (array.size()==0) return "{}";
   string str;
@@ -45,9 +64,4 @@ template<typename T> string print(const vector<T>& array) {
   return str;
 }
 
-template<typename T, typename U> ostream& operator<<(ostream& out, pair<T, U> P) {
-  out << "{" << P.first << "," << P.second << "}";
-  return out;
-}
-
 #endif